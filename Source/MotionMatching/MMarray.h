@@ -5,6 +5,9 @@
 
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "Misc/FileHelper.h" //    ߰
@@ -36,36 +39,37 @@ public:
 // here is used to indicate the data should not
 // alias against any other input parameters and 
 // can sometimes produce important performance
-// gains.
+// gains. Sizes and indices are 64 bit so that 
+// large databases can't overflow them.
 
 template<typename T>
 struct slice1d
 {
-    int size;
+    int64_t size;
     T* __restrict data;
 
-    slice1d(int _size, T* _data) : size(_size), data(_data) {}
+    slice1d(int64_t _size, T* _data) : size(_size), data(_data) {}
 
     void zero() { memset((char*)data, 0, sizeof(T) * size); }
-    void set(const T& x) { for (int i = 0; i < size; i++) { data[i] = x; } }
+    void set(const T& x) { for (int64_t i = 0; i < size; i++) { data[i] = x; } }
 
-    inline T& operator()(int i) const { assert(i >= 0 && i < size); return data[i]; }
+    inline T& operator()(int64_t i) const { assert(i >= 0 && i < size); return data[i]; }
 };
 
 // Same but for a 2d array of data.
 template<typename T>
 struct slice2d
 {
-    int rows, cols;
+    int64_t rows, cols;
     T* __restrict data;
 
-    slice2d(int _rows, int _cols, T* _data) : rows(_rows), cols(_cols), data(_data) {}
+    slice2d(int64_t _rows, int64_t _cols, T* _data) : rows(_rows), cols(_cols), data(_data) {}
 
     void zero() { memset((char*)data, 0, sizeof(T) * rows * cols); }
-    void set(const T& x) { for (int i = 0; i < rows * cols; i++) { data[i] = x; } }
+    void set(const T& x) { for (int64_t i = 0; i < rows * cols; i++) { data[i] = x; } }
 
-    inline slice1d<T> operator()(int i) const { assert(i >= 0 && i < rows); return slice1d<T>(cols, &data[i * cols]); }
-    inline T& operator()(int i, int j) const { assert(i >= 0 && i < rows && j >= 0 && j < cols); return data[i * cols + j]; }
+    inline slice1d<T> operator()(int64_t i) const { assert(i >= 0 && i < rows); return slice1d<T>(cols, &data[i * cols]); }
+    inline T& operator()(int64_t i, int64_t j) const { assert(i >= 0 && i < rows && j >= 0 && j < cols); return data[i * cols + j]; }
 };
 
 //--------------------------------------
@@ -76,11 +80,12 @@ struct slice2d
 template<typename T>
 struct array1d
 {
-    int size;
+    int64_t size;
     T* data;
+    bool view;
 
-    array1d() : size(0), data(NULL) {}
-    array1d(int _size) : array1d() { resize(_size); }
+    array1d() : size(0), data(NULL), view(false) {}
+    array1d(int64_t _size) : array1d() { resize(_size); }
     array1d(const slice1d<T>& rhs) : array1d() { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); }
     array1d(const array1d<T>& rhs) : array1d() { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); }
     ~array1d() { resize(0); }
@@ -88,14 +93,29 @@ struct array1d
     array1d& operator=(const slice1d<T>& rhs) { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); return *this; };
     array1d& operator=(const array1d<T>& rhs) { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); return *this; };
 
-    inline T& operator()(int i) const { assert(i >= 0 && i < size); return data[i]; }
+    inline T& operator()(int64_t i) const { assert(i >= 0 && i < size); return data[i]; }
     operator slice1d<T>() const { return slice1d<T>(size, data); }
 
     void zero() { memset(data, 0, sizeof(T) * size); }
-    void set(const T& x) { for (int i = 0; i < size; i++) { data[i] = x; } }
+    void set(const T& x) { for (int64_t i = 0; i < size; i++) { data[i] = x; } }
 
-    void resize(int _size)
+    void resize(int64_t _size)
     {
+        // Arrays viewing memory they do not own are first copied 
+        // into their own memory so the viewed memory is never 
+        // written to or freed
+        if (view)
+        {
+            T* view_data = data;
+            int64_t view_size = size;
+            data = NULL;
+            size = 0;
+            view = false;
+            resize(_size);
+            memcpy(data, view_data, sizeof(T) * (_size < view_size ? _size : view_size));
+            return;
+        }
+
         if (_size == 0 && size != 0)
         {
             free(data);
@@ -104,62 +124,118 @@ struct array1d
         }
         else if (_size > 0 && size == 0)
         {
-            data = (T*)malloc(_size * sizeof(T));
+            data = (T*)malloc((size_t)_size * sizeof(T));
             size = _size;
             assert(data != NULL);
         }
         else if (_size > 0 && size > 0 && _size != size)
         {
-            data = (T*)realloc(data, _size * sizeof(T));
+            data = (T*)realloc(data, (size_t)_size * sizeof(T));
             size = _size;
             assert(data != NULL);
         }
     }
 };
 
+//--------------------------------------
+
+// Width in bytes of the sizes written before the data of each
+// array. The original format, as written by the exporter, uses 
+// 32 bit sizes. Writing an array too large for them is an error
+// rather than silently truncating its size.
+enum array_extents
+{
+    ARRAY_EXTENTS_32 = 4,
+    ARRAY_EXTENTS_64 = 8,
+};
+
+static inline void array_extent_write(const int64_t extent, FILE* f, const int extents)
+{
+    if (extents == ARRAY_EXTENTS_64)
+    {
+        fwrite(&extent, sizeof(int64_t), 1, f);
+    }
+    else
+    {
+        assert(extent <= INT_MAX);
+        int extent32 = (int)extent;
+        fwrite(&extent32, sizeof(int), 1, f);
+    }
+}
+
+static inline int64_t array_extent_read(FILE* f, const int extents)
+{
+    if (extents == ARRAY_EXTENTS_64)
+    {
+        int64_t extent = 0;
+        fread(&extent, sizeof(int64_t), 1, f);
+        return extent;
+    }
+    else
+    {
+        int extent32 = 0;
+        fread(&extent32, sizeof(int), 1, f);
+        return extent32;
+    }
+}
+
 template<typename T>
-void array1d_write(const array1d<T>& arr, FILE* f)
+void array1d_write(const array1d<T>& arr, FILE* f, const int extents = ARRAY_EXTENTS_32)
 {
-    fwrite(&arr.size, sizeof(int), 1, f);
-    size_t num = fwrite(arr.data, sizeof(T), arr.size, f);
-    assert((int)num == arr.size);
+    array_extent_write(arr.size, f, extents);
+    size_t num = fwrite(arr.data, sizeof(T), (size_t)arr.size, f);
+    assert((int64_t)num == arr.size);
 }
 
 template<typename T>
-void array1d_read(array1d<T>& arr, FILE* f)
+void array1d_read(array1d<T>& arr, FILE* f, const int extents = ARRAY_EXTENTS_32)
 {
-    int size;
-    fread(&size, sizeof(int), 1, f);
+    int64_t size = array_extent_read(f, extents);
     arr.resize(size);
-    size_t num = fread(arr.data, sizeof(T), size, f);
-    assert((int)num == size);
+    size_t num = fread(arr.data, sizeof(T), (size_t)size, f);
+    assert((int64_t)num == size);
 }
 
 // Similar type but for 2d data
 template<typename T>
 struct array2d
 {
-    int rows, cols;
+    int64_t rows, cols;
     T* data;
+    bool view;
 
-    array2d() : rows(0), cols(0), data(NULL) {}
-    array2d(int _rows, int _cols) : array2d() { resize(_rows, _cols); }
+    array2d() : rows(0), cols(0), data(NULL), view(false) {}
+    array2d(int64_t _rows, int64_t _cols) : array2d() { resize(_rows, _cols); }
     ~array2d() { resize(0, 0); }
 
     array2d& operator=(const array2d<T>& rhs) { resize(rhs.rows, rhs.cols); memcpy(data, rhs.data, rhs.rows * rhs.cols * sizeof(T)); return *this; };
     array2d& operator=(const slice2d<T>& rhs) { resize(rhs.rows, rhs.cols); memcpy(data, rhs.data, rhs.rows * rhs.cols * sizeof(T)); return *this; };
 
-    inline slice1d<T> operator()(int i) const { assert(i >= 0 && i < rows); return slice1d<T>(cols, &data[i * cols]); }
-    inline T& operator()(int i, int j) const { assert(i >= 0 && i < rows && j >= 0 && j < cols); return data[i * cols + j]; }
+    inline slice1d<T> operator()(int64_t i) const { assert(i >= 0 && i < rows); return slice1d<T>(cols, &data[i * cols]); }
+    inline T& operator()(int64_t i, int64_t j) const { assert(i >= 0 && i < rows && j >= 0 && j < cols); return data[i * cols + j]; }
     operator slice2d<T>() const { return slice2d<T>(rows, cols, data); }
 
     void zero() { memset(data, 0, sizeof(T) * rows * cols); }
-    void set(const T& x) { for (int i = 0; i < rows * cols; i++) { data[i] = x; } }
+    void set(const T& x) { for (int64_t i = 0; i < rows * cols; i++) { data[i] = x; } }
 
-    void resize(int _rows, int _cols)
+    void resize(int64_t _rows, int64_t _cols)
     {
-        int _size = _rows * _cols;
-        int size = rows * cols;
+        // Same as for array1d, rows are kept where they fit
+        if (view)
+        {
+            T* view_data = data;
+            int64_t view_size = rows * cols;
+            data = NULL;
+            rows = 0;
+            cols = 0;
+            view = false;
+            resize(_rows, _cols);
+            memcpy(data, view_data, sizeof(T) * (_rows * _cols < view_size ? _rows * _cols : view_size));
+            return;
+        }
+
+        int64_t _size = _rows * _cols;
+        int64_t size = rows * cols;
 
         if (_size == 0 && size != 0)
         {
@@ -170,14 +246,14 @@ struct array2d
         }
         else if (_size > 0 && size == 0)
         {
-            data = (T*)malloc(_size * sizeof(T));
+            data = (T*)malloc((size_t)_size * sizeof(T));
             rows = _rows;
             cols = _cols;
             assert(data != NULL);
         }
         else if (_size > 0 && size > 0 && _size != size)
         {
-            data = (T*)realloc(data, _size * sizeof(T));
+            data = (T*)realloc(data, (size_t)_size * sizeof(T));
             rows = _rows;
             cols = _cols;
             assert(data != NULL);
@@ -186,23 +262,99 @@ struct array2d
 };
 
 template<typename T>
-void array2d_write(const array2d<T>& arr, FILE* f)
+void array2d_write(const array2d<T>& arr, FILE* f, const int extents = ARRAY_EXTENTS_32)
 {
-    fwrite(&arr.rows, sizeof(int), 1, f);
-    fwrite(&arr.cols, sizeof(int), 1, f);
-    size_t num = fwrite(arr.data, sizeof(T), arr.rows * arr.cols, f);
-    assert((int)num == arr.rows * arr.cols);
+    array_extent_write(arr.rows, f, extents);
+    array_extent_write(arr.cols, f, extents);
+    size_t num = fwrite(arr.data, sizeof(T), (size_t)(arr.rows * arr.cols), f);
+    assert((int64_t)num == arr.rows * arr.cols);
 }
 
 template<typename T>
-void array2d_read(array2d<T>& arr, FILE* f)
+void array2d_read(array2d<T>& arr, FILE* f, const int extents = ARRAY_EXTENTS_32)
 {
-    int rows, cols;
-    fread(&rows, sizeof(int), 1, f);
-    fread(&cols, sizeof(int), 1, f);
+    int64_t rows = array_extent_read(f, extents);
+    int64_t cols = array_extent_read(f, extents);
     arr.resize(rows, cols);
-    size_t num = fread(arr.data, sizeof(T), rows * cols, f);
-    assert((int)num == rows * cols);
+    size_t num = fread(arr.data, sizeof(T), (size_t)(rows * cols), f);
+    assert((int64_t)num == rows * cols);
+}
+
+//--------------------------------------
+
+// Make arrays view memory owned by something else, such as a
+// memory mapped file, without copying it. The viewed memory is
+// treated as read-only and must outlive the array, which makes
+// a copy of its own if it is ever resized.
+template<typename T>
+void array1d_view(array1d<T>& arr, int64_t size, T* data)
+{
+    arr.resize(0);
+    arr.size = size;
+    arr.data = size > 0 ? data : NULL;
+    arr.view = size > 0;
+}
+
+template<typename T>
+void array2d_view(array2d<T>& arr, int64_t rows, int64_t cols, T* data)
+{
+    arr.resize(0, 0);
+    arr.rows = rows;
+    arr.cols = cols;
+    arr.data = rows * cols > 0 ? data : NULL;
+    arr.view = rows * cols > 0;
+}
+
+// Read the size of an array from a buffer, advancing `ptr` past it
+static inline bool array_extent_view_read(int64_t& extent, const char*& ptr, const char* end, const int extents)
+{
+    if (end - ptr < (ptrdiff_t)extents) { return false; }
+
+    if (extents == ARRAY_EXTENTS_64)
+    {
+        memcpy(&extent, ptr, sizeof(int64_t));
+    }
+    else
+    {
+        int extent32;
+        memcpy(&extent32, ptr, sizeof(int));
+        extent = extent32;
+    }
+
+    ptr += extents;
+    return extent >= 0;
+}
+
+// Read arrays written by `array1d_write` and `array2d_write` in
+// place from a buffer, advancing `ptr` past them. Returns false 
+// if the buffer is too small to contain the array.
+template<typename T>
+bool array1d_view_read(array1d<T>& arr, const char*& ptr, const char* end, const int extents = ARRAY_EXTENTS_32)
+{
+    int64_t size;
+    if (!array_extent_view_read(size, ptr, end, extents)) { return false; }
+
+    if ((uint64_t)size > (uint64_t)(end - ptr) / sizeof(T)) { return false; }
+    assert((size_t)ptr % alignof(T) == 0);
+    array1d_view(arr, size, (T*)ptr);
+    ptr += size * sizeof(T);
+    return true;
+}
+
+template<typename T>
+bool array2d_view_read(array2d<T>& arr, const char*& ptr, const char* end, const int extents = ARRAY_EXTENTS_32)
+{
+    int64_t rows, cols;
+    if (!array_extent_view_read(rows, ptr, end, extents) ||
+        !array_extent_view_read(cols, ptr, end, extents)) { return false; }
+
+    // Checked by division so that huge shapes can't overflow
+    uint64_t available = (uint64_t)(end - ptr) / sizeof(T);
+    if (cols > 0 && (uint64_t)rows > available / (uint64_t)cols) { return false; }
+    assert((size_t)ptr % alignof(T) == 0);
+    array2d_view(arr, rows, cols, (T*)ptr);
+    ptr += rows * cols * sizeof(T);
+    return true;
 }
 
 
@@ -0,0 +1,368 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "MMasset.h"
+
+#include "Async/Async.h"
+#include "Async/ParallelFor.h"
+#include "Misc/ScopeLock.h"
+
+MMasset::MMasset()
+{
+}
+
+MMasset::~MMasset()
+{
+}
+
+
+//---------------------------------------------------------------
+static void motion_matching_asset_prune(
+    database& db,
+    const motion_matching_asset_settings& settings)
+{
+    array2d<float> queries;
+
+    FILE* f = fopen(TCHAR_TO_ANSI(*(settings.directory + TEXT("/queries.bin"))), "rb");
+    if (f != NULL)
+    {
+        array2d_read(queries, f);
+        fclose(f);
+    }
+
+    // Queries recorded with a different schema can't be replayed
+    if (queries.cols != db.nfeatures())
+    {
+        queries.resize(0, 0);
+    }
+
+    database_prune_report report;
+    database_prune(
+        db,
+        report,
+        queries,
+        settings.prune_feature_tolerance,
+        settings.prune_position_tolerance,
+        settings.prune_rotation_tolerance,
+        settings.prune_ignore_frames,
+        settings.prune_ignore_frames);
+
+    UE_LOG(LogTemp, Log, TEXT("Pruned %d of %d searchable frames (%d whole ranges), over %d replayed queries cost increased by %f on average and %f at most"),
+        report.nframes_pruned,
+        report.nframes_searchable,
+        report.nranges_pruned,
+        report.nqueries,
+        report.mean_cost_increase,
+        report.max_cost_increase);
+}
+
+static void motion_matching_asset_load_database(
+    motion_matching_asset& asset,
+    const motion_matching_asset_settings& settings)
+{
+    database& db = asset.db;
+
+    FString DatabasePath = settings.directory + TEXT("/database.bin");
+
+    if (!settings.memory_mapped ||
+        !mapped_file_open(asset.database_file, TCHAR_TO_ANSI(*DatabasePath), settings.huge_pages) ||
+        !database_load_mapped(db, asset.database_file.data, asset.database_file.size))
+    {
+        database_load(db, TCHAR_TO_ANSI(*DatabasePath));
+    }
+
+    db.frame_rate = settings.frame_rate;
+
+    if (settings.mirror)
+    {
+        database_mirror(db, settings.contact_bones);
+    }
+
+    // Load the matching features baked for this data and this schema,
+    // only building them if the baked data is missing or stale
+
+    uint64_t hash = database_source_hash(TCHAR_TO_ANSI(*DatabasePath), db, settings.schema, settings.reorder_frames);
+
+    // Pruning is baked too so its settings are part of the hash
+    if (settings.prune_feature_tolerance > 0.0f)
+    {
+        const float tolerances[3] = {
+            settings.prune_feature_tolerance,
+            settings.prune_position_tolerance,
+            settings.prune_rotation_tolerance };
+
+        hash = database_hash_bytes(hash, tolerances, sizeof(tolerances));
+        hash = database_hash_bytes(hash, &settings.prune_ignore_frames, sizeof(int));
+    }
+
+    // Named by the hash so that characters with different settings
+    // sharing a directory don't keep replacing each other's file
+    FString BakedPath = FString::Printf(TEXT("%s/database_baked_%016llx.bin"), *settings.directory, (unsigned long long)hash);
+
+    asset.timing.baked_loaded = settings.memory_mapped ?
+        mapped_file_open(asset.database_baked_file, TCHAR_TO_ANSI(*BakedPath), settings.huge_pages) &&
+        database_load_baked_mapped(db, asset.database_baked_file.data, asset.database_baked_file.size, hash) :
+        database_load_baked(db, TCHAR_TO_ANSI(*BakedPath), hash);
+
+    if (!asset.timing.baked_loaded)
+    {
+        database_build_matching_features(db, settings.schema, settings.reorder_frames);
+
+        if (settings.prune_feature_tolerance > 0.0f)
+        {
+            motion_matching_asset_prune(db, settings);
+        }
+
+        // Nothing views the stale baked file anymore and it must be
+        // unmapped before it can be overwritten
+        mapped_file_close(asset.database_baked_file);
+
+        if (settings.save_baked)
+        {
+            database_save_baked(db, TCHAR_TO_ANSI(*BakedPath), hash);
+        }
+
+        UE_LOG(LogTemp, Log, TEXT("Baked database missing or stale, matching features rebuilt"));
+    }
+
+    UE_LOG(LogTemp, Log, TEXT("Search bounds mean extent: %f (frames reordered: %d)"),
+        database_bounds_mean_extent(db), settings.reorder_frames ? 1 : 0);
+
+    // Page the poses in per range rather than keeping them in memory.
+    // Nothing views the database file afterwards so it is unmapped.
+
+    if (settings.page_poses)
+    {
+        if (pose_pager_open(asset.pager, TCHAR_TO_ANSI(*DatabasePath), db.range_starts, db.range_stops, db.nbones(), settings.page_budget))
+        {
+            database_page_poses(db, asset.pager);
+            mapped_file_close(asset.database_file);
+
+            UE_LOG(LogTemp, Log, TEXT("Poses paged per range with a budget of %f MB"), settings.page_budget / (1024.0f * 1024.0f));
+            return;
+        }
+
+        UE_LOG(LogTemp, Warning, TEXT("Could not page poses, keeping them in memory"));
+    }
+
+    // Compress poses and drop velocities once the features no longer need them
+
+    if (settings.compress_poses)
+    {
+        float max_pos_err, max_rot_err;
+        database_compress_poses(db, max_pos_err, max_rot_err);
+
+        UE_LOG(LogTemp, Log, TEXT("Poses compressed, max position error: %f m, max rotation error: %f deg"),
+            max_pos_err, max_rot_err * 57.2957795f);
+    }
+
+    if (settings.derive_velocities)
+    {
+        database_drop_velocities(db);
+    }
+}
+
+static void motion_matching_asset_load_nnet(nnet& nn, const FString& filename)
+{
+    nnet_load(nn, TCHAR_TO_ANSI(*filename));
+}
+
+void motion_matching_asset_load(
+    motion_matching_asset& asset,
+    const motion_matching_asset_settings& settings)
+{
+    double start = FPlatformTime::Seconds();
+    double network_times[3] = { 0.0, 0.0, 0.0 };
+
+    // The database dominates so the character and the three
+    // networks are loaded alongside it rather than after it
+    ParallelFor(5, [&](int32 i)
+    {
+        double part_start = FPlatformTime::Seconds();
+
+        switch (i)
+        {
+        case 0:
+            motion_matching_asset_load_database(asset, settings);
+            asset.timing.database = FPlatformTime::Seconds() - part_start;
+            break;
+
+        case 1:
+            character_load(asset.character_data, TCHAR_TO_ANSI(*(settings.directory + TEXT("/character.bin"))));
+            asset.timing.character = FPlatformTime::Seconds() - part_start;
+            break;
+
+        case 2:
+            motion_matching_asset_load_nnet(asset.decompressor, settings.directory + TEXT("/decompressor.bin"));
+            network_times[0] = FPlatformTime::Seconds() - part_start;
+            break;
+
+        case 3:
+            motion_matching_asset_load_nnet(asset.stepper, settings.directory + TEXT("/stepper.bin"));
+            network_times[1] = FPlatformTime::Seconds() - part_start;
+            break;
+
+        case 4:
+            motion_matching_asset_load_nnet(asset.projector, settings.directory + TEXT("/projector.bin"));
+            network_times[2] = FPlatformTime::Seconds() - part_start;
+            break;
+        }
+    });
+
+    asset.timing.networks = FMath::Max3(network_times[0], network_times[1], network_times[2]);
+    asset.timing.total = FPlatformTime::Seconds() - start;
+}
+
+TFuture<void> motion_matching_asset_load_async(
+    const motion_matching_asset_ptr& asset,
+    const motion_matching_asset_settings& settings)
+{
+    // The task keeps its own reference so the asset outlives it even
+    // if whoever started loading is destroyed in the meantime, and
+    // drops it once done as the future may keep the task around
+    motion_matching_asset_ptr loading = asset;
+
+    return Async(EAsyncExecution::ThreadPool, [loading, settings]() mutable
+    {
+        motion_matching_asset_load(*loading, settings);
+        loading.Reset();
+    });
+}
+
+//---------------------------------------------------------------
+uint64_t motion_matching_asset_key(const motion_matching_asset_settings& settings)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    hash = database_hash_bytes(hash, *settings.directory, settings.directory.Len() * sizeof(TCHAR));
+    hash = database_hash_bytes(hash, settings.schema.channels.data, settings.schema.channels.size * sizeof(feature_channel));
+    hash = database_hash_bytes(hash, settings.contact_bones.data, settings.contact_bones.size * sizeof(int));
+
+    // Saving the baked database and the paging budget don't change
+    // what is loaded so are left out
+    const int flags[8] = {
+        settings.reorder_frames,
+        settings.mirror,
+        settings.memory_mapped,
+        settings.huge_pages,
+        settings.compress_poses,
+        settings.derive_velocities,
+        settings.page_poses,
+        settings.prune_ignore_frames };
+
+    const float values[4] = {
+        settings.prune_feature_tolerance,
+        settings.prune_position_tolerance,
+        settings.prune_rotation_tolerance,
+        settings.frame_rate };
+
+    hash = database_hash_bytes(hash, flags, sizeof(flags));
+    hash = database_hash_bytes(hash, values, sizeof(values));
+
+    return hash;
+}
+
+// Assets are only weakly referenced here so that they are freed as
+// soon as no character uses them
+struct motion_matching_asset_entry
+{
+    motion_matching_asset_weak_ptr asset;
+    TSharedFuture<void> loading;
+};
+
+static FCriticalSection motion_matching_asset_lock;
+static TMap<uint64_t, motion_matching_asset_entry> motion_matching_assets;
+
+motion_matching_asset_ptr motion_matching_asset_acquire(
+    TSharedFuture<void>& loading,
+    const motion_matching_asset_settings& settings)
+{
+    const uint64_t key = motion_matching_asset_key(settings);
+
+    FScopeLock lock(&motion_matching_asset_lock);
+
+    motion_matching_asset_entry* entry = motion_matching_assets.Find(key);
+    if (entry != NULL)
+    {
+        motion_matching_asset_ptr asset = entry->asset.Pin();
+        if (asset.IsValid())
+        {
+            loading = entry->loading;
+            return asset;
+        }
+    }
+
+    // Drop the entries of assets which have since been freed
+    for (auto it = motion_matching_assets.CreateIterator(); it; ++it)
+    {
+        if (!it.Value().asset.IsValid())
+        {
+            it.RemoveCurrent();
+        }
+    }
+
+    motion_matching_asset_ptr asset = MakeShared<motion_matching_asset, ESPMode::ThreadSafe>();
+    loading = motion_matching_asset_load_async(asset, settings).Share();
+
+    motion_matching_asset_entry& added = motion_matching_assets.Add(key);
+    added.asset = asset;
+    added.loading = loading;
+
+    return asset;
+}
+
+motion_matching_asset_ptr motion_matching_asset_reload(
+    TSharedFuture<void>& loading,
+    const motion_matching_asset_settings& settings,
+    const motion_matching_asset_ptr& current)
+{
+    const uint64_t key = motion_matching_asset_key(settings);
+
+    FScopeLock lock(&motion_matching_asset_lock);
+
+    motion_matching_asset_entry* entry = motion_matching_assets.Find(key);
+    if (entry != NULL)
+    {
+        motion_matching_asset_ptr asset = entry->asset.Pin();
+        if (asset.IsValid() && asset != current)
+        {
+            loading = entry->loading;
+            return asset;
+        }
+    }
+
+    motion_matching_asset_ptr asset = MakeShared<motion_matching_asset, ESPMode::ThreadSafe>();
+    loading = motion_matching_asset_load_async(asset, settings).Share();
+
+    motion_matching_asset_entry& added = motion_matching_assets.Add(key);
+    added.asset = asset;
+    added.loading = loading;
+
+    return asset;
+}
+
+void motion_matching_asset_forget(const motion_matching_asset_ptr& asset)
+{
+    FScopeLock lock(&motion_matching_asset_lock);
+
+    for (auto it = motion_matching_assets.CreateIterator(); it; ++it)
+    {
+        if (it.Value().asset.Pin() == asset)
+        {
+            it.RemoveCurrent();
+        }
+    }
+}
+
+int motion_matching_asset_count()
+{
+    FScopeLock lock(&motion_matching_asset_lock);
+
+    int count = 0;
+    for (const auto& pair : motion_matching_assets)
+    {
+        count += pair.Value.asset.IsValid() ? 1 : 0;
+    }
+
+    return count;
+}
@@ -0,0 +1,154 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+
+#include "MMcharacter.h"
+#include "MMdatabase.h"
+#include "MMmapped.h"
+#include "MMnnet.h"
+#include "MMpager.h"
+
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+
+/**
+ * 
+ */
+class MOTIONMATCHING_API MMasset
+{
+public:
+	MMasset();
+	~MMasset();
+};
+
+
+//---------------------------------------------------------------
+
+// How to load and build an asset
+struct motion_matching_asset_settings
+{
+    // Directory containing character.bin, database.bin, the
+    // network files and database_baked_<hash>.bin for each hash
+    // of the database and settings it was baked from
+    FString directory;
+
+    feature_schema schema;
+    bool reorder_frames = true;
+
+    // Mirror the database virtually, see `database_mirror`, with the
+    // bone of each contact state in the database
+    bool mirror = false;
+    array1d<int> contact_bones;
+
+    bool memory_mapped = true;
+    bool huge_pages = false;
+    bool compress_poses = false;
+    bool derive_velocities = false;
+
+    // Read the poses in per range when needed rather than keeping
+    // them in memory, keeping at most `page_budget` bytes of them.
+    // Takes precedence over compressing poses and dropping velocities.
+    bool page_poses = false;
+    size_t page_budget = 64 << 20;
+
+    // Exclude from the search the frames which have a near duplicate
+    // elsewhere in the database as done by `database_prune`. Off when
+    // the feature tolerance is zero. Only done when the features are
+    // rebuilt, the frames excluded being saved with the baked data.
+    // Queries recorded in queries.bin in the directory, if any, are 
+    // replayed to report the effect.
+    float prune_feature_tolerance = 0.0f;
+    float prune_position_tolerance = 0.01f;
+    float prune_rotation_tolerance = 0.05f;
+    int prune_ignore_frames = 20;
+
+    // Write the baked database when it had to be rebuilt
+    bool save_baked = false;
+
+    float frame_rate = 60.0f;
+};
+
+// Wall clock seconds spent on each part of loading. Parts are
+// loaded in parallel so the total is less than their sum.
+struct motion_matching_asset_timing
+{
+    double character = 0.0;
+    double database = 0.0;
+    double networks = 0.0;
+    double total = 0.0;
+
+    // If the baked features were loaded rather than rebuilt
+    bool baked_loaded = false;
+};
+
+// Everything motion matching loads from disk or builds from it,
+// as opposed to the state of a single character playing it back
+struct motion_matching_asset
+{
+    // Declared before the database so the files are unmapped
+    // only after it is destroyed
+    mapped_file database_file;
+    mapped_file database_baked_file;
+    pose_pager pager;
+
+    character character_data;
+    database db;
+    nnet decompressor;
+    nnet stepper;
+    nnet projector;
+
+    motion_matching_asset_timing timing;
+};
+
+typedef TSharedPtr<motion_matching_asset, ESPMode::ThreadSafe> motion_matching_asset_ptr;
+typedef TWeakPtr<motion_matching_asset, ESPMode::ThreadSafe> motion_matching_asset_weak_ptr;
+
+// Load the character, database and networks, each on its own worker
+// thread, and then build or load the matching features of the database
+void motion_matching_asset_load(
+    motion_matching_asset& asset,
+    const motion_matching_asset_settings& settings);
+
+// Same but without blocking. The asset must not be touched until
+// the returned future is ready.
+TFuture<void> motion_matching_asset_load_async(
+    const motion_matching_asset_ptr& asset,
+    const motion_matching_asset_settings& settings);
+
+//---------------------------------------------------------------
+
+// Hash of everything in the settings that changes the contents of
+// an asset: the source directory, the feature schema and weights,
+// and how the database is built and stored
+uint64_t motion_matching_asset_key(const motion_matching_asset_settings& settings);
+
+// Get the asset loaded with these settings, starting to load it if
+// no character currently holds it. Characters of the same type then
+// share a single copy which must be treated as read only, and which
+// is freed once the last of them releases its handle. `loading` is
+// set to a future which is ready once the asset can be used.
+motion_matching_asset_ptr motion_matching_asset_acquire(
+    TSharedFuture<void>& loading,
+    const motion_matching_asset_settings& settings);
+
+// Load the asset with these settings again from disk without 
+// blocking, such as after the data was exported again, and hand
+// out the new one to characters acquiring it from then on. `current`
+// is the asset the caller holds: if another character already 
+// started reloading it, the asset being reloaded is shared instead
+// of loading it once per character. Characters holding the old 
+// asset keep using it until they swap in the new one.
+motion_matching_asset_ptr motion_matching_asset_reload(
+    TSharedFuture<void>& loading,
+    const motion_matching_asset_settings& settings,
+    const motion_matching_asset_ptr& current);
+
+// Stop handing out an asset to characters acquiring it afterwards, 
+// such as when its contents no longer match the settings it was 
+// loaded with. Characters holding it keep using it.
+void motion_matching_asset_forget(const motion_matching_asset_ptr& asset);
+
+// Number of assets currently held by at least one character
+int motion_matching_asset_count();
@@ -2,6 +2,7 @@
 
 
 #include "MMcharacter.h"
+#include "MMformat.h"
 
 MMcharacter::MMcharacter()
 {
@@ -12,9 +13,58 @@ MMcharacter::~MMcharacter()
 }
 
 
+//------------------------------------------------------
+int bone_mirror(const int bone)
+{
+    switch (bone)
+    {
+    case Bone_LeftUpLeg: return Bone_RightUpLeg;
+    case Bone_LeftLeg: return Bone_RightLeg;
+    case Bone_LeftFoot: return Bone_RightFoot;
+    case Bone_LeftToe: return Bone_RightToe;
+    case Bone_RightUpLeg: return Bone_LeftUpLeg;
+    case Bone_RightLeg: return Bone_LeftLeg;
+    case Bone_RightFoot: return Bone_LeftFoot;
+    case Bone_RightToe: return Bone_LeftToe;
+    case Bone_LeftShoulder: return Bone_RightShoulder;
+    case Bone_LeftArm: return Bone_RightArm;
+    case Bone_LeftForeArm: return Bone_RightForeArm;
+    case Bone_LeftHand: return Bone_RightHand;
+    case Bone_RightShoulder: return Bone_LeftShoulder;
+    case Bone_RightArm: return Bone_LeftArm;
+    case Bone_RightForeArm: return Bone_LeftForeArm;
+    case Bone_RightHand: return Bone_LeftHand;
+    default: return bone;
+    }
+}
+
 //------------------------------------------------------
 void character_load(character& c, const char* filename)
 {
+    format_reader r;
+    if (format_open(r, filename, FORMAT_CHARACTER))
+    {
+        bool valid =
+            format_read_array1d(r, 0, c.positions) &&
+            format_read_array1d(r, 1, c.normals) &&
+            format_read_array1d(r, 2, c.texcoords) &&
+            format_read_array1d(r, 3, c.triangles) &&
+            format_read_array2d(r, 4, c.bone_weights) &&
+            format_read_array2d(r, 5, c.bone_indices) &&
+            format_read_array1d(r, 6, c.bone_rest_positions) &&
+            format_read_array1d(r, 7, c.bone_rest_rotations);
+
+        assert(valid);
+        format_close(r);
+        return;
+    }
+
+    if (r.invalid)
+    {
+        return;
+    }
+
+    // Original format
     FILE* f = fopen(filename, "rb");
     assert(f != NULL);
 
@@ -32,6 +82,24 @@ void character_load(character& c, const char* filename)
     fclose(f);
 }
 
+void character_save(const character& c, const char* filename)
+{
+    format_writer w;
+    bool opened = format_write_begin(w, filename, FORMAT_CHARACTER, 8);
+    assert(opened);
+
+    format_write_array1d(w, c.positions);
+    format_write_array1d(w, c.normals);
+    format_write_array1d(w, c.texcoords);
+    format_write_array1d(w, c.triangles);
+    format_write_array2d(w, c.bone_weights);
+    format_write_array2d(w, c.bone_indices);
+    format_write_array1d(w, c.bone_rest_positions);
+    format_write_array1d(w, c.bone_rest_rotations);
+
+    format_write_end(w);
+}
+
 
 //------------------------------------------------------
 void linear_blend_skinning_positions(
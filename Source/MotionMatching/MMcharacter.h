@@ -54,6 +54,10 @@ enum Bones
     Bone_RightHand = 22,
 };
 
+// The bone on the other side of the body, or the bone itself for 
+// bones along the spine
+int bone_mirror(const int bone);
+
 //--------------------------------------
 
 struct character
@@ -75,6 +79,10 @@ struct character
 //-------------------------------------------------
 void character_load(character& c, const char* filename);
 
+// Save in the versioned format of MMformat.h, which `character_load`
+// reads as well as the original one
+void character_save(const character& c, const char* filename);
+
 
 void linear_blend_skinning_positions(
     slice1d<vec3> anim_positions,
@@ -2,6 +2,17 @@
 
 
 #include "MMdatabase.h"
+#include "MMformat.h"
+#include "MMpager.h"
+
+#include "Async/ParallelFor.h"
+#include "HAL/PlatformFileManager.h"
+
+#include <algorithm>
+
+static_assert(BUILD_CHUNK_SIZE % BOUND_LR_SIZE == 0, "Build chunks must not split bounding boxes");
+
+static void database_build_feature_mirrors(database& db);
 
 MMdatabase::MMdatabase()
 {
@@ -12,9 +23,75 @@ MMdatabase::~MMdatabase()
 }
 
 
+//---------------------------------------------------------------
+// Contact states are stored in files unpacked, one bool per
+// contact per frame, as the exporter writes them
+static void database_pack_contacts(database& db, const slice2d<bool> contact_states)
+{
+    assert(contact_states.cols <= CONTACT_MAX);
+
+    db.contact_count = (int)contact_states.cols;
+    db.contact_bits.resize(contact_bits_words((int)contact_states.rows, db.contact_count));
+    db.contact_bits.zero();
+
+    for (int i = 0; i < contact_states.rows; i++)
+    {
+        uint32_t mask = 0;
+        for (int c = 0; c < db.contact_count; c++)
+        {
+            mask |= contact_states(i, c) ? 1u << c : 0u;
+        }
+
+        contact_bits_set(db.contact_bits, db.contact_count, i, mask);
+    }
+}
+
+static void database_unpack_contacts(array2d<bool>& contact_states, const database& db)
+{
+    contact_states.resize(db.nframes(), db.ncontacts());
+
+    for (int i = 0; i < db.nframes(); i++)
+    {
+        uint32_t mask = contact_bits_get(db.contact_bits, db.ncontacts(), i);
+        for (int c = 0; c < db.ncontacts(); c++)
+        {
+            contact_states(i, c) = (mask >> c) & 1;
+        }
+    }
+}
+
 //---------------------------------------------------------------
 void database_load(database& db, const char* filename)
 {
+    array2d<bool> contact_states;
+
+    format_reader r;
+    if (format_open(r, filename, FORMAT_DATABASE))
+    {
+        bool valid =
+            format_read_array2d(r, 0, db.bone_positions) &&
+            format_read_array2d(r, 1, db.bone_velocities) &&
+            format_read_array2d(r, 2, db.bone_rotations) &&
+            format_read_array2d(r, 3, db.bone_angular_velocities) &&
+            format_read_array1d(r, 4, db.bone_parents) &&
+            format_read_array1d(r, 5, db.range_starts) &&
+            format_read_array1d(r, 6, db.range_stops) &&
+            format_read_array2d(r, 7, contact_states);
+
+        assert(valid);
+        format_close(r);
+
+        database_pack_contacts(db, contact_states);
+        database_build_frame_ranges(db);
+        return;
+    }
+
+    if (r.invalid)
+    {
+        return;
+    }
+
+    // Original format
     FILE* f = fopen(filename, "rb");
     assert(f != NULL);
 
@@ -27,106 +104,427 @@ void database_load(database& db, const char* filename)
     array1d_read(db.range_starts, f);
     array1d_read(db.range_stops, f);
 
-    array2d_read(db.contact_states, f);
+    array2d_read(contact_states, f);
 
     fclose(f);
+
+    database_pack_contacts(db, contact_states);
+    database_build_frame_ranges(db);
 }
 
 //---------------------------------------------------------------
-void database_save_matching_features(const database& db, const char* filename)
+void database_save(const database& db, const char* filename)
 {
-    FILE* f = fopen(filename, "wb");
-    assert(f != NULL);
+    assert(!db.compressed() && !db.paged());
 
-    array2d_write(db.features, f);
-    array1d_write(db.features_offset, f);
-    array1d_write(db.features_scale, f);
+    format_writer w;
+    bool opened = format_write_begin(w, filename, FORMAT_DATABASE, 8);
+    assert(opened);
 
-    fclose(f);
+    format_write_array2d(w, db.bone_positions);
+    format_write_array2d(w, db.bone_velocities);
+    format_write_array2d(w, db.bone_rotations);
+    format_write_array2d(w, db.bone_angular_velocities);
+    format_write_array1d(w, db.bone_parents);
+    format_write_array1d(w, db.range_starts);
+    format_write_array1d(w, db.range_stops);
 
-    UE_LOG(LogTemp, Log, TEXT("Feature vector data generation and save complete"));
+    array2d<bool> contact_states;
+    database_unpack_contacts(contact_states, db);
+    format_write_array2d(w, contact_states);
+
+    format_write_end(w);
 }
 
 //---------------------------------------------------------------
-// When we add an offset to a frame in the database there is a chance
-// it will go out of the relevant range so here we can clamp it to 
-// the last frame of that range.
-int database_trajectory_index_clamp(database& db, int frame, int offset)
+bool database_load_mapped(database& db, const char* data, const size_t size)
 {
-    for (int i = 0; i < db.nranges(); i++)
+    // Contact states are small enough that packing them into memory
+    // of their own costs little compared to viewing the poses
+    array2d<bool> contact_states;
+
+    format_reader r;
+    if (format_open_memory(r, data, size, FORMAT_DATABASE))
     {
-        if (frame >= db.range_starts(i) && frame < db.range_stops(i))
+        bool valid =
+            format_view_array2d(r, 0, db.bone_positions) &&
+            format_view_array2d(r, 1, db.bone_velocities) &&
+            format_view_array2d(r, 2, db.bone_rotations) &&
+            format_view_array2d(r, 3, db.bone_angular_velocities) &&
+            format_view_array1d(r, 4, db.bone_parents) &&
+            format_view_array1d(r, 5, db.range_starts) &&
+            format_view_array1d(r, 6, db.range_stops) &&
+            format_view_array2d(r, 7, contact_states);
+
+        format_close(r);
+
+        if (!valid)
         {
-            return clamp(frame + offset, db.range_starts(i), db.range_stops(i) - 1);
+            return false;
         }
+
+        database_pack_contacts(db, contact_states);
+        database_build_frame_ranges(db);
+        return true;
     }
 
-    assert(false);
-    return -1;
+    if (r.invalid)
+    {
+        return false;
+    }
+
+    // Original format
+    const char* ptr = data;
+    const char* end = data + size;
+
+    bool valid =
+        array2d_view_read(db.bone_positions, ptr, end) &&
+        array2d_view_read(db.bone_velocities, ptr, end) &&
+        array2d_view_read(db.bone_rotations, ptr, end) &&
+        array2d_view_read(db.bone_angular_velocities, ptr, end) &&
+        array1d_view_read(db.bone_parents, ptr, end) &&
+        array1d_view_read(db.range_starts, ptr, end) &&
+        array1d_view_read(db.range_stops, ptr, end) &&
+        array2d_view_read(contact_states, ptr, end);
+
+    if (!valid)
+    {
+        return false;
+    }
+
+    database_pack_contacts(db, contact_states);
+    database_build_frame_ranges(db);
+
+    return true;
 }
 
 //---------------------------------------------------------------
-void normalize_feature(
-    slice2d<float> features,
-    slice1d<float> features_offset,
-    slice1d<float> features_scale,
-    const int offset,
-    const int size,
-    const float weight = 1.0f)
+void database_build_frame_ranges(database& db)
 {
-    // First compute what is essentially the mean 
-    // value for each feature dimension
-    for (int j = 0; j < size; j++)
-    {
-        features_offset(offset + j) = 0.0f;
-    }
+    db.frame_ranges.resize(db.nframes());
+    db.frame_ranges.set(-1);
 
-    for (int i = 0; i < features.rows; i++)
+    for (int r = 0; r < db.nranges(); r++)
     {
-        for (int j = 0; j < size; j++)
+        for (int i = db.range_starts(r); i < db.range_stops(r); i++)
         {
-            features_offset(offset + j) += features(i, offset + j) / features.rows;
+            db.frame_ranges(i) = r;
         }
     }
+}
 
-    // Now compute the variance of each feature dimension
-    array1d<float> vars(size);
-    vars.zero();
+//---------------------------------------------------------------
+uint64_t database_hash_bytes(uint64_t hash, const void* data, const size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+template<typename T>
+static uint64_t database_hash_array1d(uint64_t hash, const array1d<T>& arr)
+{
+    hash = database_hash_bytes(hash, &arr.size, sizeof(arr.size));
+    return database_hash_bytes(hash, arr.data, arr.size * sizeof(T));
+}
 
-    for (int i = 0; i < features.rows; i++)
+uint64_t database_source_hash(
+    const char* filename,
+    const database& db,
+    const feature_schema& schema,
+    const bool reorder_frames)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    int version = DATABASE_BAKED_VERSION;
+    hash = database_hash_bytes(hash, &version, sizeof(int));
+
+    // The source data is identified without reading it, by the section
+    // table of files in the versioned format, which holds the checksum
+    // of every array, or else by the size and modification time
+
+    format_reader r;
+    if (format_open(r, filename, FORMAT_DATABASE))
     {
-        for (int j = 0; j < size; j++)
-        {
-            vars(j) += squaref(features(i, offset + j) - features_offset(offset + j)) / features.rows;
-        }
+        hash = database_hash_bytes(hash, r.sections.data, r.sections.size * sizeof(format_section));
+        format_close(r);
+    }
+    else
+    {
+        IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+        int64 size = PlatformFile.FileSize(ANSI_TO_TCHAR(filename));
+        int64 ticks = PlatformFile.GetTimeStamp(ANSI_TO_TCHAR(filename)).GetTicks();
+
+        hash = database_hash_bytes(hash, &size, sizeof(int64));
+        hash = database_hash_bytes(hash, &ticks, sizeof(int64));
     }
 
-    // We compute the overall std of the feature as the average
-    // std across all dimensions
-    float std = 0.0f;
-    for (int j = 0; j < size; j++)
+    hash = database_hash_array1d(hash, schema.channels);
+    hash = database_hash_bytes(hash, &reorder_frames, sizeof(bool));
+
+    // Mirroring changes the normalization
+    if (db.mirrored())
     {
-        std += sqrtf(vars(j)) / size;
+        hash = database_hash_array1d(hash, db.bone_mirrors);
+        hash = database_hash_array1d(hash, db.contact_mirrors);
     }
 
-    // Features with no variation can have zero std which is
-    // almost always a bug.
-    assert(std > 0.0);
+    return hash;
+}
 
-    // The scale of a feature is just the std divided by the weight
-    for (int j = 0; j < size; j++)
+//---------------------------------------------------------------
+void database_save_baked(const database& db, const char* filename, const uint64_t source_hash)
+{
+    // Written next to the final file and moved into place once complete
+    // so that nothing ever loads or maps a partially written file
+    FString FinalPath = ANSI_TO_TCHAR(filename);
+    FString TempPath = FinalPath + TEXT(".tmp");
+
+    FILE* f = fopen(TCHAR_TO_ANSI(*TempPath), "wb");
+    if (f == NULL)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Could not write baked database"));
+        return;
+    }
+
+    int magic = DATABASE_BAKED_MAGIC;
+    int version = DATABASE_BAKED_VERSION;
+    fwrite(&magic, sizeof(int), 1, f);
+    fwrite(&version, sizeof(int), 1, f);
+    fwrite(&source_hash, sizeof(uint64_t), 1, f);
+
+    array1d_write(db.schema.channels, f, ARRAY_EXTENTS_64);
+    array2d_write(db.features, f, ARRAY_EXTENTS_64);
+    array1d_write(db.features_offset, f, ARRAY_EXTENTS_64);
+    array1d_write(db.features_scale, f, ARRAY_EXTENTS_64);
+    array1d_write(db.search_order, f, ARRAY_EXTENTS_64);
+    array2d_write(db.bound_sm_min, f, ARRAY_EXTENTS_64);
+    array2d_write(db.bound_sm_max, f, ARRAY_EXTENTS_64);
+    array2d_write(db.bound_lr_min, f, ARRAY_EXTENTS_64);
+    array2d_write(db.bound_lr_max, f, ARRAY_EXTENTS_64);
+    array1d_write(db.searchable, f, ARRAY_EXTENTS_64);
+
+    bool written = !ferror(f);
+    written = fclose(f) == 0 && written;
+
+    // The final file is named by the hash so one already there holds the
+    // same data, and may be in use, in which case the new one is dropped
+    IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+    PlatformFile.DeleteFile(*FinalPath);
+
+    if (!written || !PlatformFile.MoveFile(*FinalPath, *TempPath))
+    {
+        PlatformFile.DeleteFile(*TempPath);
+        UE_LOG(LogTemp, Warning, TEXT("Could not write baked database"));
+    }
+}
+
+//---------------------------------------------------------------
+bool database_load_baked(database& db, const char* filename, const uint64_t source_hash)
+{
+    // The whole file is read in and parsed as when it is mapped, which
+    // checks that every array lies within it, so that a truncated or
+    // partially written file is rebuilt rather than loaded as garbage
+    IFileHandle* handle = FPlatformFileManager::Get().GetPlatformFile().OpenRead(ANSI_TO_TCHAR(filename));
+    if (handle == NULL)
     {
-        features_scale(offset + j) = std / weight;
+        return false;
     }
 
-    // Using the offset and scale we can then normalize the features
-    for (int i = 0; i < features.rows; i++)
+    array1d<char> data(handle->Size());
+    bool read = handle->Read((uint8*)data.data, data.size);
+    delete handle;
+
+    if (!read || !database_load_baked_mapped(db, data.data, data.size, source_hash))
+    {
+        return false;
+    }
+
+    // Copy the arrays out of the buffer before it is freed
+    db.schema.channels.resize(db.schema.channels.size);
+    db.features.resize(db.features.rows, db.features.cols);
+    db.features_offset.resize(db.features_offset.size);
+    db.features_scale.resize(db.features_scale.size);
+    db.search_order.resize(db.search_order.size);
+    db.bound_sm_min.resize(db.bound_sm_min.rows, db.bound_sm_min.cols);
+    db.bound_sm_max.resize(db.bound_sm_max.rows, db.bound_sm_max.cols);
+    db.bound_lr_min.resize(db.bound_lr_min.rows, db.bound_lr_min.cols);
+    db.bound_lr_max.resize(db.bound_lr_max.rows, db.bound_lr_max.cols);
+    db.searchable.resize(db.searchable.size);
+
+    return true;
+}
+
+//---------------------------------------------------------------
+void feature_schema_add_bone_position(feature_schema& schema, const int bone, const float weight)
+{
+    feature_channel channel;
+    channel.type = FEATURE_BONE_POSITION;
+    channel.bone = bone;
+    channel.weight = weight;
+
+    schema.channels.resize(schema.channels.size + 1);
+    schema.channels(schema.channels.size - 1) = channel;
+}
+
+void feature_schema_add_bone_velocity(feature_schema& schema, const int bone, const float weight)
+{
+    feature_channel channel;
+    channel.type = FEATURE_BONE_VELOCITY;
+    channel.bone = bone;
+    channel.weight = weight;
+
+    schema.channels.resize(schema.channels.size + 1);
+    schema.channels(schema.channels.size - 1) = channel;
+}
+
+static void feature_schema_add_trajectory(feature_schema& schema, const int type, const slice1d<int> offsets, const float weight)
+{
+    assert(offsets.size <= FEATURE_MAX_OFFSETS);
+
+    feature_channel channel;
+    channel.type = type;
+    channel.noffsets = offsets.size;
+    for (int i = 0; i < offsets.size; i++)
+    {
+        channel.offsets[i] = offsets(i);
+    }
+    channel.weight = weight;
+
+    schema.channels.resize(schema.channels.size + 1);
+    schema.channels(schema.channels.size - 1) = channel;
+}
+
+void feature_schema_add_trajectory_position(feature_schema& schema, const slice1d<int> offsets, const float weight)
+{
+    feature_schema_add_trajectory(schema, FEATURE_TRAJECTORY_POSITION, offsets, weight);
+}
+
+void feature_schema_add_trajectory_direction(feature_schema& schema, const slice1d<int> offsets, const float weight)
+{
+    feature_schema_add_trajectory(schema, FEATURE_TRAJECTORY_DIRECTION, offsets, weight);
+}
+
+int feature_schema_find(int& offset, const feature_schema& schema, const int type, const int bone)
+{
+    offset = 0;
+    for (int c = 0; c < schema.nchannels(); c++)
     {
-        for (int j = 0; j < size; j++)
+        const feature_channel& channel = schema.channels(c);
+
+        bool bone_channel = type == FEATURE_BONE_POSITION || type == FEATURE_BONE_VELOCITY;
+        if (channel.type == type && (!bone_channel || channel.bone == bone))
         {
-            features(i, offset + j) = (features(i, offset + j) - features_offset(offset + j)) / features_scale(offset + j);
+            return c;
         }
+
+        offset += channel.size();
+    }
+
+    return -1;
+}
+
+void feature_schema_default(
+    feature_schema& schema,
+    const float feature_weight_foot_position,
+    const float feature_weight_foot_velocity,
+    const float feature_weight_hip_velocity,
+    const float feature_weight_trajectory_positions,
+    const float feature_weight_trajectory_directions,
+    const float frame_rate)
+{
+    int trajectory_offsets[3] = {
+        (int)(frame_rate / 3.0f + 0.5f),
+        (int)(2.0f * frame_rate / 3.0f + 0.5f),
+        (int)(frame_rate + 0.5f) };
+
+    schema.channels.resize(0);
+    feature_schema_add_bone_position(schema, Bone_LeftFoot, feature_weight_foot_position);
+    feature_schema_add_bone_position(schema, Bone_RightFoot, feature_weight_foot_position);
+    feature_schema_add_bone_velocity(schema, Bone_LeftFoot, feature_weight_foot_velocity);
+    feature_schema_add_bone_velocity(schema, Bone_RightFoot, feature_weight_foot_velocity);
+    feature_schema_add_bone_velocity(schema, Bone_Hips, feature_weight_hip_velocity);
+    feature_schema_add_trajectory_position(schema, slice1d<int>(3, trajectory_offsets), feature_weight_trajectory_positions);
+    feature_schema_add_trajectory_direction(schema, slice1d<int>(3, trajectory_offsets), feature_weight_trajectory_directions);
+}
+
+//---------------------------------------------------------------
+bool database_load_baked_mapped(database& db, const char* data, const size_t size, const uint64_t source_hash)
+{
+    const char* ptr = data;
+    const char* end = data + size;
+
+    int magic = 0, version = 0;
+    uint64_t hash = 0;
+
+    if (size < 2 * sizeof(int) + sizeof(uint64_t))
+    {
+        return false;
+    }
+
+    memcpy(&magic, ptr, sizeof(int)); ptr += sizeof(int);
+    memcpy(&version, ptr, sizeof(int)); ptr += sizeof(int);
+    memcpy(&hash, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+
+    if (magic != DATABASE_BAKED_MAGIC || version != DATABASE_BAKED_VERSION || hash != source_hash)
+    {
+        return false;
+    }
+
+    bool valid =
+        array1d_view_read(db.schema.channels, ptr, end, ARRAY_EXTENTS_64) &&
+        array2d_view_read(db.features, ptr, end, ARRAY_EXTENTS_64) &&
+        array1d_view_read(db.features_offset, ptr, end, ARRAY_EXTENTS_64) &&
+        array1d_view_read(db.features_scale, ptr, end, ARRAY_EXTENTS_64) &&
+        array1d_view_read(db.search_order, ptr, end, ARRAY_EXTENTS_64) &&
+        array2d_view_read(db.bound_sm_min, ptr, end, ARRAY_EXTENTS_64) &&
+        array2d_view_read(db.bound_sm_max, ptr, end, ARRAY_EXTENTS_64) &&
+        array2d_view_read(db.bound_lr_min, ptr, end, ARRAY_EXTENTS_64) &&
+        array2d_view_read(db.bound_lr_max, ptr, end, ARRAY_EXTENTS_64) &&
+        array1d_view_read(db.searchable, ptr, end, ARRAY_EXTENTS_64) &&
+        db.features.rows == db.nframes() &&
+        (db.searchable.size == 0 || db.searchable.size == db.nframes());
+
+    // Don't leave anything viewing a file which is no good
+    if (!valid)
+    {
+        db.schema.channels.resize(0);
+        db.features.resize(0, 0);
+        db.features_offset.resize(0);
+        db.features_scale.resize(0);
+        db.search_order.resize(0);
+        db.bound_sm_min.resize(0, 0);
+        db.bound_sm_max.resize(0, 0);
+        db.bound_lr_min.resize(0, 0);
+        db.bound_lr_max.resize(0, 0);
+        db.searchable.resize(0);
+        return false;
+    }
+
+    database_build_feature_mirrors(db);
+
+    return true;
+}
+
+//---------------------------------------------------------------
+// When we add an offset to a frame in the database there is a chance
+// it will go out of the relevant range so here we can clamp it to 
+// the last frame of that range.
+int database_trajectory_index_clamp(const database& db, int frame, int offset)
+{
+    // Mirrored frames are clamped to the range of the frame they mirror
+    if (frame >= db.nframes())
+    {
+        return db.nframes() + database_trajectory_index_clamp(db, frame - db.nframes(), offset);
     }
+
+    int r = db.frame_ranges(frame);
+    assert(r != -1);
+
+    return clamp(frame + offset, db.range_starts(r), db.range_stops(r) - 1);
 }
 
 //---------------------------------------------------------------
@@ -354,209 +752,1664 @@ void forward_kinematics_velocity_partial(
 
 
 //---------------------------------------------------------------
-// Compute a feature for the position of a bone relative to the simulation/root bone
-void compute_bone_position_feature(database& db, int& offset, int bone, float weight = 1.0f)
+// Number of chunks of BUILD_CHUNK_SIZE frames (or slots) the 
+// database is split into when building it in parallel
+static int database_build_nchunks(const database& db)
 {
-    for (int i = 0; i < db.nframes(); i++)
+    return (db.nframes() + BUILD_CHUNK_SIZE - 1) / BUILD_CHUNK_SIZE;
+}
+
+//---------------------------------------------------------------
+// Scratch buffer holding the global transforms and velocities of
+// the bones needed by the features for a chunk of frames, as well
+// as the inverse root rotation of each frame. Computed once so 
+// that each feature reads it instead of redoing the FK.
+struct database_fk_chunk
+{
+    int start = 0;
+    array2d<vec3> global_positions;
+    array2d<vec3> global_velocities;
+    array2d<quat> global_rotations;
+    array2d<vec3> global_angular_velocities;
+    array1d<quat> root_inverse_rotations;
+    array1d<vec3> local_velocities;
+    array1d<vec3> local_angular_velocities;
+};
+
+// Mark a bone and all of its ancestors as needed
+static void database_fk_require(slice1d<bool> bone_needed, const slice1d<int> bone_parents, int bone)
+{
+    while (bone != -1 && !bone_needed(bone))
     {
-        vec3 bone_position;
-        quat bone_rotation;
+        bone_needed(bone) = true;
+        bone = bone_parents(bone);
+    }
+}
 
-        forward_kinematics(
-            bone_position,
-            bone_rotation,
-            db.bone_positions(i),
-            db.bone_rotations(i),
-            db.bone_parents,
-            bone);
+// Forward kinematics with velocity for the needed bones of the 
+// frames in [start, stop). This is the same computation as 
+// `forward_kinematics_velocity` but done iteratively in a single 
+// pass since parents always come before their children.
+static void database_fk_compute(
+    database_fk_chunk& fk,
+    const database& db,
+    const slice1d<bool> bone_needed,
+    const int start,
+    const int stop)
+{
+    fk.start = start;
+    fk.global_positions.resize(stop - start, db.nbones());
+    fk.global_velocities.resize(stop - start, db.nbones());
+    fk.global_rotations.resize(stop - start, db.nbones());
+    fk.global_angular_velocities.resize(stop - start, db.nbones());
+    fk.root_inverse_rotations.resize(stop - start);
+
+    bool derived = db.velocities_derived();
+    if (derived)
+    {
+        fk.local_velocities.resize(db.nbones());
+        fk.local_angular_velocities.resize(db.nbones());
+    }
+
+    for (int i = start; i < stop; i++)
+    {
+        int k = i - start;
+
+        if (derived)
+        {
+            database_pose(
+                slice1d<vec3>(0, NULL),
+                fk.local_velocities,
+                slice1d<quat>(0, NULL),
+                fk.local_angular_velocities,
+                db, i);
+        }
+
+        const slice1d<vec3> local_velocities = derived ? (slice1d<vec3>)fk.local_velocities : db.bone_velocities(i);
+        const slice1d<vec3> local_angular_velocities = derived ? (slice1d<vec3>)fk.local_angular_velocities : db.bone_angular_velocities(i);
+
+        for (int b = 0; b < db.nbones(); b++)
+        {
+            if (!bone_needed(b))
+            {
+                continue;
+            }
+
+            int p = db.bone_parents(b);
+
+            if (p != -1)
+            {
+                assert(p < b);
+
+                fk.global_positions(k, b) = quat_mul_vec3(fk.global_rotations(k, p), db.bone_positions(i, b)) + fk.global_positions(k, p);
+                fk.global_velocities(k, b) =
+                    fk.global_velocities(k, p) +
+                    quat_mul_vec3(fk.global_rotations(k, p), local_velocities(b)) +
+                    cross(fk.global_angular_velocities(k, p), quat_mul_vec3(fk.global_rotations(k, p), db.bone_positions(i, b)));
+                fk.global_rotations(k, b) = quat_mul(fk.global_rotations(k, p), db.bone_rotations(i, b));
+                fk.global_angular_velocities(k, b) = quat_mul_vec3(fk.global_rotations(k, p), local_angular_velocities(b)) + fk.global_angular_velocities(k, p);
+            }
+            else
+            {
+                fk.global_positions(k, b) = db.bone_positions(i, b);
+                fk.global_velocities(k, b) = local_velocities(b);
+                fk.global_rotations(k, b) = db.bone_rotations(i, b);
+                fk.global_angular_velocities(k, b) = local_angular_velocities(b);
+            }
+        }
+
+        fk.root_inverse_rotations(k) = quat_inv(db.bone_rotations(i, 0));
+    }
+}
+
+//---------------------------------------------------------------
+// Compute a feature for the position of a bone relative to the simulation/root bone
+static void compute_bone_position_feature(database& db, const database_fk_chunk& fk, const int offset, const int bone, const int start, const int stop)
+{
+    for (int i = start; i < stop; i++)
+    {
+        int k = i - fk.start;
 
-        bone_position = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), bone_position - db.bone_positions(i, 0));
+        vec3 bone_position = quat_mul_vec3(fk.root_inverse_rotations(k), fk.global_positions(k, bone) - db.bone_positions(i, 0));
 
         db.features(i, offset + 0) = bone_position.x;
         db.features(i, offset + 1) = bone_position.y;
         db.features(i, offset + 2) = bone_position.z;
     }
-
-    normalize_feature(db.features, db.features_offset, db.features_scale, offset, 3, weight);
-
-    offset += 3;
 }
 
 
 //---------------------------------------------------------------
 // Similar but for a bone's velocity
-void compute_bone_velocity_feature(database& db, int& offset, int bone, float weight = 1.0f)
+static void compute_bone_velocity_feature(database& db, const database_fk_chunk& fk, const int offset, const int bone, const int start, const int stop)
 {
-    for (int i = 0; i < db.nframes(); i++)
+    for (int i = start; i < stop; i++)
     {
-        vec3 bone_position;
-        vec3 bone_velocity;
-        quat bone_rotation;
-        vec3 bone_angular_velocity;
+        int k = i - fk.start;
 
-        forward_kinematics_velocity(
-            bone_position,
-            bone_velocity,
-            bone_rotation,
-            bone_angular_velocity,
-            db.bone_positions(i),
-            db.bone_velocities(i),
-            db.bone_rotations(i),
-            db.bone_angular_velocities(i),
-            db.bone_parents,
-            bone);
-
-        bone_velocity = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), bone_velocity);
+        vec3 bone_velocity = quat_mul_vec3(fk.root_inverse_rotations(k), fk.global_velocities(k, bone));
 
         db.features(i, offset + 0) = bone_velocity.x;
         db.features(i, offset + 1) = bone_velocity.y;
         db.features(i, offset + 2) = bone_velocity.z;
     }
-
-    normalize_feature(db.features, db.features_offset, db.features_scale, offset, 3, weight);
-
-    offset += 3;
 }
 
 
 //---------------------------------------------------------------
-// Compute the trajectory at 20, 40, and 60 frames in the future
-void compute_trajectory_position_feature(database& db, int& offset, float weight = 1.0f)
+// Compute the trajectory at the channel's offsets in the future
+static void compute_trajectory_position_feature(database& db, const database_fk_chunk& fk, const int offset, const feature_channel& channel, const int start, const int stop)
 {
-    for (int i = 0; i < db.nframes(); i++)
+    for (int i = start; i < stop; i++)
     {
-        int t0 = database_trajectory_index_clamp(db, i, 20);
-        int t1 = database_trajectory_index_clamp(db, i, 40);
-        int t2 = database_trajectory_index_clamp(db, i, 60);
-
-        vec3 trajectory_pos0 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t0, 0) - db.bone_positions(i, 0));
-        vec3 trajectory_pos1 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t1, 0) - db.bone_positions(i, 0));
-        vec3 trajectory_pos2 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), db.bone_positions(t2, 0) - db.bone_positions(i, 0));
+        int k = i - fk.start;
 
-        db.features(i, offset + 0) = trajectory_pos0.x;
-        db.features(i, offset + 1) = trajectory_pos0.z;
-        db.features(i, offset + 2) = trajectory_pos1.x;
-        db.features(i, offset + 3) = trajectory_pos1.z;
-        db.features(i, offset + 4) = trajectory_pos2.x;
-        db.features(i, offset + 5) = trajectory_pos2.z;
-    }
+        for (int s = 0; s < channel.noffsets; s++)
+        {
+            int t = database_trajectory_index_clamp(db, i, channel.offsets[s]);
 
-    normalize_feature(db.features, db.features_offset, db.features_scale, offset, 6, weight);
+            vec3 trajectory_pos = quat_mul_vec3(fk.root_inverse_rotations(k), db.bone_positions(t, 0) - db.bone_positions(i, 0));
 
-    offset += 6;
+            db.features(i, offset + 2 * s + 0) = trajectory_pos.x;
+            db.features(i, offset + 2 * s + 1) = trajectory_pos.z;
+        }
+    }
 }
 
 
 //---------------------------------------------------------------
 // Same for direction
-void compute_trajectory_direction_feature(database& db, int& offset, float weight = 1.0f)
+static void compute_trajectory_direction_feature(database& db, const database_fk_chunk& fk, const int offset, const feature_channel& channel, const int start, const int stop)
 {
-    for (int i = 0; i < db.nframes(); i++)
+    for (int i = start; i < stop; i++)
     {
-        int t0 = database_trajectory_index_clamp(db, i, 20);
-        int t1 = database_trajectory_index_clamp(db, i, 40);
-        int t2 = database_trajectory_index_clamp(db, i, 60);
-
-        vec3 trajectory_dir0 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t0, 0), vec3(0, 0, 1)));
-        vec3 trajectory_dir1 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t1, 0), vec3(0, 0, 1)));
-        vec3 trajectory_dir2 = quat_mul_vec3(quat_inv(db.bone_rotations(i, 0)), quat_mul_vec3(db.bone_rotations(t2, 0), vec3(0, 0, 1)));
+        int k = i - fk.start;
 
-        db.features(i, offset + 0) = trajectory_dir0.x;
-        db.features(i, offset + 1) = trajectory_dir0.z;
-        db.features(i, offset + 2) = trajectory_dir1.x;
-        db.features(i, offset + 3) = trajectory_dir1.z;
-        db.features(i, offset + 4) = trajectory_dir2.x;
-        db.features(i, offset + 5) = trajectory_dir2.z;
-    }
+        for (int s = 0; s < channel.noffsets; s++)
+        {
+            int t = database_trajectory_index_clamp(db, i, channel.offsets[s]);
 
-    normalize_feature(db.features, db.features_offset, db.features_scale, offset, 6, weight);
+            vec3 trajectory_dir = quat_mul_vec3(fk.root_inverse_rotations(k), quat_mul_vec3(db.bone_rotations(t, 0), vec3(0, 0, 1)));
 
-    offset += 6;
+            db.features(i, offset + 2 * s + 0) = trajectory_dir.x;
+            db.features(i, offset + 2 * s + 1) = trajectory_dir.z;
+        }
+    }
 }
 
+
 //---------------------------------------------------------------
-// Build the Motion Matching search acceleration structure. Here we
-// just use axis aligned bounding boxes regularly spaced at BOUND_SM_SIZE
-// and BOUND_LR_SIZE frames
-void database_build_bounds(database& db)
+// Compute all the (unnormalized) features for the frames in 
+// [start, stop), first doing the FK for the whole chunk at once.
+// If given, the mean and sum of squared differences from the mean
+// of each feature dimension over the chunk are also computed.
+static void database_compute_features(
+    database& db,
+    slice1d<double> chunk_mean,
+    slice1d<double> chunk_m2,
+    const int start,
+    const int stop)
 {
-    int nbound_sm = ((db.nframes() + BOUND_SM_SIZE - 1) / BOUND_SM_SIZE);
-    int nbound_lr = ((db.nframes() + BOUND_LR_SIZE - 1) / BOUND_LR_SIZE);
+    array1d<bool> bone_needed(db.nbones());
+    bone_needed.zero();
+    for (int c = 0; c < db.schema.nchannels(); c++)
+    {
+        const feature_channel& channel = db.schema.channels(c);
+        if (channel.type == FEATURE_BONE_POSITION || channel.type == FEATURE_BONE_VELOCITY)
+        {
+            database_fk_require(bone_needed, db.bone_parents, channel.bone);
+        }
+    }
+
+    database_fk_chunk fk;
+    database_fk_compute(fk, db, bone_needed, start, stop);
 
-    db.bound_sm_min.resize(nbound_sm, db.nfeatures());
-    db.bound_sm_max.resize(nbound_sm, db.nfeatures());
-    db.bound_lr_min.resize(nbound_lr, db.nfeatures());
-    db.bound_lr_max.resize(nbound_lr, db.nfeatures());
+    int offset = 0;
+    for (int c = 0; c < db.schema.nchannels(); c++)
+    {
+        const feature_channel& channel = db.schema.channels(c);
+
+        switch (channel.type)
+        {
+        case FEATURE_BONE_POSITION: compute_bone_position_feature(db, fk, offset, channel.bone, start, stop); break;
+        case FEATURE_BONE_VELOCITY: compute_bone_velocity_feature(db, fk, offset, channel.bone, start, stop); break;
+        case FEATURE_TRAJECTORY_POSITION: compute_trajectory_position_feature(db, fk, offset, channel, start, stop); break;
+        case FEATURE_TRAJECTORY_DIRECTION: compute_trajectory_direction_feature(db, fk, offset, channel, start, stop); break;
+        default: assert(false);
+        }
+
+        offset += channel.size();
+    }
 
-    db.bound_sm_min.set(+FLT_MAX);
-    db.bound_sm_max.set(-FLT_MAX);
-    db.bound_lr_min.set(+FLT_MAX);
-    db.bound_lr_max.set(-FLT_MAX);
+    assert(offset == db.nfeatures());
 
-    for (int i = 0; i < db.nframes(); i++)
+    // Accumulate statistics with Welford's algorithm while 
+    // the features of the chunk are still in cache
+    if (chunk_mean.size > 0)
     {
-        int i_sm = i / BOUND_SM_SIZE;
-        int i_lr = i / BOUND_LR_SIZE;
+        chunk_mean.zero();
+        chunk_m2.zero();
 
-        for (int j = 0; j < db.nfeatures(); j++)
+        for (int i = start; i < stop; i++)
         {
-            db.bound_sm_min(i_sm, j) = minf(db.bound_sm_min(i_sm, j), db.features(i, j));
-            db.bound_sm_max(i_sm, j) = maxf(db.bound_sm_max(i_sm, j), db.features(i, j));
-            db.bound_lr_min(i_lr, j) = minf(db.bound_lr_min(i_lr, j), db.features(i, j));
-            db.bound_lr_max(i_lr, j) = maxf(db.bound_lr_max(i_lr, j), db.features(i, j));
+            int count = i - start + 1;
+            for (int j = 0; j < db.nfeatures(); j++)
+            {
+                double delta = db.features(i, j) - chunk_mean(j);
+                chunk_mean(j) += delta / count;
+                chunk_m2(j) += delta * (db.features(i, j) - chunk_mean(j));
+            }
         }
     }
 }
 
 //---------------------------------------------------------------
-// Build all motion matching features and acceleration structure
-void database_build_matching_features(
+// Set the offset and scale of a group of feature dimensions. The
+// offset is the mean and the scale is the average std across all
+// dimensions of the group divided by the weight.
+static void database_normalization_group(
     database& db,
-    const float feature_weight_foot_position,
-    const float feature_weight_foot_velocity,
-    const float feature_weight_hip_velocity,
-    const float feature_weight_trajectory_positions,
-    const float feature_weight_trajectory_directions)
+    int& offset,
+    const slice1d<double> means,
+    const slice1d<double> vars,
+    const int size,
+    const float weight)
 {
-    int nfeatures =
-        3 + // Left Foot Position
-        3 + // Right Foot Position 
-        3 + // Left Foot Velocity
-        3 + // Right Foot Velocity
-        3 + // Hip Velocity
-        6 + // Trajectory Positions 2D
-        6; // Trajectory Directions 2D
+    float std = 0.0f;
+    for (int j = 0; j < size; j++)
+    {
+        std += sqrtf((float)vars(offset + j)) / size;
+    }
 
-    db.features.resize(db.nframes(), nfeatures);
-    db.features_offset.resize(nfeatures);
+    // Features with no variation can have zero std which is
+    // almost always a bug.
+    assert(std > 0.0);
+
+    for (int j = 0; j < size; j++)
+    {
+        db.features_offset(offset + j) = (float)means(offset + j);
+        db.features_scale(offset + j) = std / weight;
+    }
+
+    offset += size;
+}
+
+//---------------------------------------------------------------
+// Normalize all feature dimensions of the frames in [start, stop)
+static void database_normalize_features(database& db, const int start, const int stop)
+{
+    for (int i = start; i < stop; i++)
+    {
+        for (int j = 0; j < db.nfeatures(); j++)
+        {
+            db.features(i, j) = (db.features(i, j) - db.features_offset(j)) / db.features_scale(j);
+        }
+    }
+}
+
+//---------------------------------------------------------------
+// Find the box boundary nearest to the middle of a segment of
+// slots, or -1 if there is no boundary strictly inside it
+static int database_reorder_split(int start, int stop, int box_size)
+{
+    int split = (((start + stop) / 2 + box_size / 2) / box_size) * box_size;
+    return split > start && split < stop ? split : -1;
+}
+
+static void database_reorder_segment(database& db, int start, int stop)
+{
+    // Prefer to split at large box boundaries so that each large
+    // box is made from a contiguous part of the split hierarchy
+    int split = database_reorder_split(start, stop, BOUND_LR_SIZE);
+    if (split == -1)
+    {
+        split = database_reorder_split(start, stop, BOUND_SM_SIZE);
+    }
+
+    // Segment is entirely inside one small box
+    if (split == -1)
+    {
+        return;
+    }
+
+    // Find the feature dimension with the largest extent
+    int split_dim = 0;
+    float split_extent = -1.0f;
+    for (int j = 0; j < db.nfeatures(); j++)
+    {
+        float fmin = +FLT_MAX;
+        float fmax = -FLT_MAX;
+        for (int i = start; i < stop; i++)
+        {
+            fmin = minf(fmin, db.features(db.search_order(i), j));
+            fmax = maxf(fmax, db.features(db.search_order(i), j));
+        }
+
+        if (fmax - fmin > split_extent)
+        {
+            split_dim = j;
+            split_extent = fmax - fmin;
+        }
+    }
+
+    // Partition the slots around the split along that dimension
+    std::nth_element(
+        db.search_order.data + start,
+        db.search_order.data + split,
+        db.search_order.data + stop,
+        [&db, split_dim](int a, int b) { return db.features(a, split_dim) < db.features(b, split_dim); });
+
+    database_reorder_segment(db, start, split);
+    database_reorder_segment(db, split, stop);
+}
+
+// Sum of the extents of the parts of the small boxes which 
+// cover a segment of slots
+static float database_reorder_extent(const database& db, int start, int stop)
+{
+    float extent = 0.0f;
+    for (int i = start; i < stop; i = (i / BOUND_SM_SIZE + 1) * BOUND_SM_SIZE)
+    {
+        int i_sm_end = std::min((i / BOUND_SM_SIZE + 1) * BOUND_SM_SIZE, stop);
+
+        for (int j = 0; j < db.nfeatures(); j++)
+        {
+            float fmin = +FLT_MAX;
+            float fmax = -FLT_MAX;
+            for (int k = i; k < i_sm_end; k++)
+            {
+                fmin = minf(fmin, db.features(db.search_order(k), j));
+                fmax = maxf(fmax, db.features(db.search_order(k), j));
+            }
+            extent += fmax - fmin;
+        }
+    }
+
+    return extent;
+}
+
+//---------------------------------------------------------------
+// Reorder the slots of a single range, which must currently 
+// hold the frames of that range in database order
+static void database_reorder_range(database& db, int r)
+{
+    int start = db.range_starts(r);
+    int stop = db.range_stops(r);
+
+    float extent_before = database_reorder_extent(db, start, stop);
+
+    database_reorder_segment(db, start, stop);
+
+    // Short ranges are often already tighter in time order
+    // in which case we keep it as it is
+    if (database_reorder_extent(db, start, stop) >= extent_before)
+    {
+        for (int i = start; i < stop; i++)
+        {
+            db.search_order(i) = i;
+        }
+    }
+}
+
+//---------------------------------------------------------------
+// Permute the frames of each range in the search order so that
+// frames which are close in feature space end up in the same
+// bounding boxes.
+void database_reorder_frames(database& db)
+{
+    db.search_order.resize(db.nframes());
+    for (int i = 0; i < db.nframes(); i++)
+    {
+        db.search_order(i) = i;
+    }
+
+    // Ranges are reordered independently of each other
+    ParallelFor(db.nranges(), [&](int32 r)
+    {
+        database_reorder_range(db, r);
+    });
+}
+
+//---------------------------------------------------------------
+// Make sure a transposed bound array has at least `ncols` 
+// columns, keeping the existing bounds. Capacity is grown 
+// geometrically so that appending frames one range at a time 
+// only copies the bounds an amortized constant number of times.
+// Bounds viewing a mapped file are always copied, as the boxes
+// are then written to.
+static void database_bounds_reserve(array2d<float>& bound, int nrows, int ncols)
+{
+    if (bound.rows == nrows && bound.cols >= ncols && !bound.view)
+    {
+        return;
+    }
+
+    // Pad to whole blocks so the search never has to 
+    // deal with partially filled blocks of boxes
+    int ncols_new = 
+        bound.rows != nrows ? ncols : 
+        bound.cols >= ncols ? (int)bound.cols :
+        (int)std::max<int64_t>(ncols, 2 * bound.cols);
+    ncols_new = ((ncols_new + BOUND_BLOCK_SIZE - 1) / BOUND_BLOCK_SIZE) * BOUND_BLOCK_SIZE;
+
+    array2d<float> bound_new(nrows, ncols_new);
+    bound_new.zero();
+
+    if (bound.rows == nrows)
+    {
+        for (int j = 0; j < nrows; j++)
+        {
+            memcpy(&bound_new(j, 0), &bound(j, 0), bound.cols * sizeof(float));
+        }
+    }
+
+    bound.resize(0, 0);
+    bound = bound_new;
+}
+
+//---------------------------------------------------------------
+// Extend the bounds to cover the slots from `start` onwards. 
+// The bounds of all boxes before `start` must already be built. 
+// The box containing `start` may be partially filled in which 
+// case it is grown, and any boxes after it are created.
+static void database_extend_bounds(database& db, int start)
+{
+    int nbound_sm_prev = (start + BOUND_SM_SIZE - 1) / BOUND_SM_SIZE;
+    int nbound_lr_prev = (start + BOUND_LR_SIZE - 1) / BOUND_LR_SIZE;
+    int nbound_sm = db.nbound_sm();
+    int nbound_lr = db.nbound_lr();
+
+    database_bounds_reserve(db.bound_sm_min, db.nfeatures(), nbound_sm);
+    database_bounds_reserve(db.bound_sm_max, db.nfeatures(), nbound_sm);
+    database_bounds_reserve(db.bound_lr_min, db.nfeatures(), nbound_lr);
+    database_bounds_reserve(db.bound_lr_max, db.nfeatures(), nbound_lr);
+
+    for (int j = 0; j < db.nfeatures(); j++)
+    {
+        for (int i = nbound_sm_prev; i < nbound_sm; i++)
+        {
+            db.bound_sm_min(j, i) = +FLT_MAX;
+            db.bound_sm_max(j, i) = -FLT_MAX;
+        }
+
+        for (int i = nbound_lr_prev; i < nbound_lr; i++)
+        {
+            db.bound_lr_min(j, i) = +FLT_MAX;
+            db.bound_lr_max(j, i) = -FLT_MAX;
+        }
+    }
+
+    // Chunks are aligned to large boxes so each box is 
+    // only ever updated by a single task
+    int chunk_start = start / BUILD_CHUNK_SIZE;
+    ParallelFor(database_build_nchunks(db) - chunk_start, [&](int32 c)
+    {
+        int chunk_slot_start = std::max((chunk_start + c) * BUILD_CHUNK_SIZE, start);
+        int chunk_slot_stop = std::min((chunk_start + c + 1) * BUILD_CHUNK_SIZE, db.nframes());
+
+        for (int i = chunk_slot_start; i < chunk_slot_stop; i++)
+        {
+            int i_sm = i / BOUND_SM_SIZE;
+            int i_lr = i / BOUND_LR_SIZE;
+            int frame = db.search_order.size > 0 ? db.search_order(i) : i;
+
+            if (db.searchable.size > 0 && !db.searchable(frame))
+            {
+                continue;
+            }
+
+            for (int j = 0; j < db.nfeatures(); j++)
+            {
+                db.bound_sm_min(j, i_sm) = minf(db.bound_sm_min(j, i_sm), db.features(frame, j));
+                db.bound_sm_max(j, i_sm) = maxf(db.bound_sm_max(j, i_sm), db.features(frame, j));
+                db.bound_lr_min(j, i_lr) = minf(db.bound_lr_min(j, i_lr), db.features(frame, j));
+                db.bound_lr_max(j, i_lr) = maxf(db.bound_lr_max(j, i_lr), db.features(frame, j));
+            }
+        }
+    });
+}
+
+//---------------------------------------------------------------
+// Build the Motion Matching search acceleration structure. Here we
+// just use axis aligned bounding boxes regularly spaced at BOUND_SM_SIZE
+// and BOUND_LR_SIZE slots of the search order
+void database_build_bounds(database& db)
+{
+    db.bound_sm_min.resize(0, 0);
+    db.bound_sm_max.resize(0, 0);
+    db.bound_lr_min.resize(0, 0);
+    db.bound_lr_max.resize(0, 0);
+
+    database_extend_bounds(db, 0);
+}
+
+//---------------------------------------------------------------
+// Average extent of the small bounding boxes over all feature 
+// dimensions. Smaller values mean boxes which prune more often.
+float database_bounds_mean_extent(const database& db)
+{
+    if (db.nbound_sm() == 0 || db.nfeatures() == 0)
+    {
+        return 0.0f;
+    }
+
+    // Boxes holding no searchable frame are empty and left out
+    float extent = 0.0f;
+    int count = 0;
+    for (int j = 0; j < db.nfeatures(); j++)
+    {
+        for (int i = 0; i < db.nbound_sm(); i++)
+        {
+            if (db.bound_sm_min(j, i) <= db.bound_sm_max(j, i))
+            {
+                extent += db.bound_sm_max(j, i) - db.bound_sm_min(j, i);
+                count++;
+            }
+        }
+    }
+
+    return count > 0 ? extent / count : 0.0f;
+}
+
+//---------------------------------------------------------------
+// Build all motion matching features and acceleration structure
+void database_build_matching_features(
+    database& db,
+    const feature_schema& schema,
+    const bool reorder_frames)
+{
+    assert(!db.compressed() && !db.paged());
+
+    db.schema = schema;
+
+    database_build_feature_mirrors(db);
+
+    int nfeatures = schema.nfeatures();
+
+    database_build_frame_ranges(db);
+
+    db.features.resize(db.nframes(), nfeatures);
+    db.features_offset.resize(nfeatures);
     db.features_scale.resize(nfeatures);
 
-    int offset = 0;
-    compute_bone_position_feature(db, offset, Bone_LeftFoot, feature_weight_foot_position);
-    compute_bone_position_feature(db, offset, Bone_RightFoot, feature_weight_foot_position);
-    compute_bone_velocity_feature(db, offset, Bone_LeftFoot, feature_weight_foot_velocity);
-    compute_bone_velocity_feature(db, offset, Bone_RightFoot, feature_weight_foot_velocity);
-    compute_bone_velocity_feature(db, offset, Bone_Hips, feature_weight_hip_velocity);
-    compute_trajectory_position_feature(db, offset, feature_weight_trajectory_positions);
-    compute_trajectory_direction_feature(db, offset, feature_weight_trajectory_directions);
+    // Compute features along with statistics for each chunk
+    int nchunks = database_build_nchunks(db);
+    array2d<double> chunk_means(nchunks, nfeatures);
+    array2d<double> chunk_m2s(nchunks, nfeatures);
+
+    ParallelFor(nchunks, [&](int32 c)
+    {
+        int start = c * BUILD_CHUNK_SIZE;
+        int stop = std::min(start + BUILD_CHUNK_SIZE, db.nframes());
+
+        database_compute_features(db, chunk_means(c), chunk_m2s(c), start, stop);
+    });
+
+    // Merge the statistics of the chunks in order
+    array1d<double> means(nfeatures);
+    array1d<double> vars(nfeatures);
+    means.zero();
+    vars.zero();
+
+    int count = 0;
+    for (int c = 0; c < nchunks; c++)
+    {
+        int chunk_count = std::min((c + 1) * BUILD_CHUNK_SIZE, db.nframes()) - c * BUILD_CHUNK_SIZE;
+        int total = count + chunk_count;
+
+        for (int j = 0; j < nfeatures; j++)
+        {
+            double delta = chunk_means(c, j) - means(j);
+            means(j) += delta * chunk_count / total;
+            vars(j) += chunk_m2s(c, j) + delta * delta * ((double)count * chunk_count / total);
+        }
+
+        count = total;
+    }
+
+    for (int j = 0; j < nfeatures; j++)
+    {
+        vars(j) /= count;
+    }
+
+    // Take the statistics over the mirrored frames too so that the
+    // normalization is symmetric and the mirror of the normalized 
+    // features is the same permutation and sign flip as of the raw ones
+    if (db.mirrored())
+    {
+        array1d<double> mirrored_means(nfeatures);
+        array1d<double> mirrored_vars(nfeatures);
+
+        for (int j = 0; j < nfeatures; j++)
+        {
+            int m = db.feature_mirrors(j);
+            double sign = db.feature_mirror_signs(j);
+
+            mirrored_means(j) = 0.5 * (means(j) + sign * means(m));
+            mirrored_vars(j) = 0.5 * (vars(j) + means(j) * means(j) + vars(m) + means(m) * means(m)) - 
+                mirrored_means(j) * mirrored_means(j);
+        }
+
+        means = mirrored_means;
+        vars = mirrored_vars;
+    }
+
+    int offset = 0;
+    for (int c = 0; c < schema.nchannels(); c++)
+    {
+        database_normalization_group(db, offset, means, vars, schema.channels(c).size(), schema.channels(c).weight);
+    }
+
+    assert(offset == nfeatures);
+
+    // Normalize all feature dimensions in a single sweep
+    ParallelFor(nchunks, [&](int32 c)
+    {
+        int start = c * BUILD_CHUNK_SIZE;
+        int stop = std::min(start + BUILD_CHUNK_SIZE, db.nframes());
+
+        database_normalize_features(db, start, stop);
+    });
+
+    if (reorder_frames)
+    {
+        database_reorder_frames(db);
+    }
+    else
+    {
+        db.search_order.resize(0);
+    }
+
+    db.searchable.resize(0);
+
+    database_build_bounds(db);
+}
+
+
+//---------------------------------------------------------------
+// Compute the normalized features of the frames of a clip about to
+// be appended from frame `start` on. Features only depend on frames 
+// of their own range so they are computed on a copy of the clip, 
+// at full precision even if the database stores compressed poses.
+static void database_append_features(database& db, const database& clip, const int start)
+{
+    database staged;
+    staged.bone_positions = clip.bone_positions;
+    staged.bone_velocities = clip.bone_velocities;
+    staged.bone_rotations = clip.bone_rotations;
+    staged.bone_angular_velocities = clip.bone_angular_velocities;
+    staged.bone_parents = clip.bone_parents;
+    staged.range_starts = clip.range_starts;
+    staged.range_stops = clip.range_stops;
+    staged.frame_rate = clip.frame_rate;
+    staged.schema = db.schema;
+    staged.features_offset = db.features_offset;
+    staged.features_scale = db.features_scale;
+    staged.features.resize(clip.nframes(), db.nfeatures());
+    database_build_frame_ranges(staged);
+
+    ParallelFor(database_build_nchunks(staged), [&](int32 c)
+    {
+        int chunk_start = c * BUILD_CHUNK_SIZE;
+        int chunk_stop = std::min(chunk_start + BUILD_CHUNK_SIZE, staged.nframes());
+
+        database_compute_features(staged, slice1d<double>(0, NULL), slice1d<double>(0, NULL), chunk_start, chunk_stop);
+        database_normalize_features(staged, chunk_start, chunk_stop);
+    });
+
+    db.features.resize(start + clip.nframes(), db.nfeatures());
+    memcpy(&db.features(start, 0), staged.features.data, (size_t)staged.features.rows * staged.features.cols * sizeof(float));
+}
+
+static void database_compress_append(
+    database& db,
+    const database& clip,
+    float& max_position_error,
+    float& max_rotation_error);
+
+//---------------------------------------------------------------
+// Append the ranges of another database to the end of this one
+// and extend the matching features and acceleration structure 
+// to cover them. The existing features are left untouched since 
+// the new frames are normalized with the stored `features_offset`
+// and `features_scale`, so the cost is proportional to the number 
+// of frames appended rather than the size of the database.
+void database_append(database& db, const database& clip)
+{
+    assert(!db.paged());
+    assert(!db.mirrored());
+    assert(clip.nbones() == db.nbones());
+    assert(clip.ncontacts() == db.ncontacts());
+    assert(clip.frame_rate == db.frame_rate);
+    assert(db.features.rows == db.nframes());
+    assert(db.frame_ranges.size == db.nframes());
+
+    if (clip.nframes() == 0)
+    {
+        return;
+    }
+
+    int start = db.nframes();
+    int stop = start + clip.nframes();
+    int range_start = db.nranges();
+
+    // Pose data and ranges. Velocities of the clip are dropped 
+    // if the database derives them.
+    bool derived = db.velocities_derived();
+
+    if (db.compressed())
+    {
+        float max_pos_err, max_rot_err;
+        database_compress_append(db, clip, max_pos_err, max_rot_err);
+
+        UE_LOG(LogTemp, Log, TEXT("Appended poses compressed, max position error: %f m, max rotation error: %f deg"),
+            max_pos_err, max_rot_err * 57.2957795f);
+    }
+    else
+    {
+        db.bone_positions.resize(stop, db.nbones());
+        db.bone_rotations.resize(stop, db.nbones());
+
+        memcpy(&db.bone_positions(start, 0), clip.bone_positions.data, (size_t)clip.nframes() * clip.nbones() * sizeof(vec3));
+        memcpy(&db.bone_rotations(start, 0), clip.bone_rotations.data, (size_t)clip.nframes() * clip.nbones() * sizeof(quat));
+    }
+
+    // Contacts of the clip don't start on a word boundary in general
+    int64_t nwords = db.contact_bits.size;
+    db.contact_bits.resize(contact_bits_words(stop, db.ncontacts()));
+    for (int64_t w = nwords; w < db.contact_bits.size; w++)
+    {
+        db.contact_bits(w) = 0;
+    }
+
+    for (int i = 0; i < clip.nframes(); i++)
+    {
+        contact_bits_set(db.contact_bits, db.ncontacts(), start + i, contact_bits_get(clip.contact_bits, clip.ncontacts(), i));
+    }
+
+    if (!derived)
+    {
+        db.bone_velocities.resize(stop, db.nbones());
+        db.bone_angular_velocities.resize(stop, db.nbones());
+
+        memcpy(&db.bone_velocities(start, 0), clip.bone_velocities.data, (size_t)clip.nframes() * clip.nbones() * sizeof(vec3));
+        memcpy(&db.bone_angular_velocities(start, 0), clip.bone_angular_velocities.data, (size_t)clip.nframes() * clip.nbones() * sizeof(vec3));
+    }
+
+    db.range_starts.resize(range_start + clip.nranges());
+    db.range_stops.resize(range_start + clip.nranges());
+
+    for (int r = 0; r < clip.nranges(); r++)
+    {
+        db.range_starts(range_start + r) = start + clip.range_starts(r);
+        db.range_stops(range_start + r) = start + clip.range_stops(r);
+    }
+
+    db.frame_ranges.resize(stop);
+    for (int i = start; i < stop; i++)
+    {
+        db.frame_ranges(i) = -1;
+    }
+
+    for (int r = range_start; r < db.nranges(); r++)
+    {
+        for (int i = db.range_starts(r); i < db.range_stops(r); i++)
+        {
+            db.frame_ranges(i) = r;
+        }
+    }
+
+    // Compute features of new frames, normalizing 
+    // them with the existing offset and scale
+    database_append_features(db, clip, start);
+
+    // Extend search order, reordering only the new ranges
+    if (db.search_order.size > 0)
+    {
+        db.search_order.resize(stop);
+        for (int i = start; i < stop; i++)
+        {
+            db.search_order(i) = i;
+        }
+
+        for (int r = range_start; r < db.nranges(); r++)
+        {
+            database_reorder_range(db, r);
+        }
+    }
+
+    // New frames are all searchable
+    if (db.searchable.size > 0)
+    {
+        db.searchable.resize(stop);
+        for (int i = start; i < stop; i++)
+        {
+            db.searchable(i) = true;
+        }
+    }
+
+    database_extend_bounds(db, start);
+}
+
+//---------------------------------------------------------------
+// The three smallest components of a unit quaternion lie within
+// +-1/sqrt(2) so that is the range they are quantized over
+static const float QUAT48_RANGE = 0.70710678f;
+static const float QUAT48_LEVELS = 32767.0f;
+
+static inline quat48 quat48_encode(quat q)
+{
+    q = quat_normalize(q);
+
+    float c[4] = { q.w, q.x, q.y, q.z };
+
+    int largest = 0;
+    for (int i = 1; i < 4; i++)
+    {
+        if (fabs(c[i]) > fabs(c[largest])) { largest = i; }
+    }
+
+    // q and -q are the same rotation so make the dropped 
+    // component positive to reconstruct it from the others
+    float sign = c[largest] < 0.0f ? -1.0f : 1.0f;
+
+    uint64_t bits = (uint64_t)largest;
+    for (int i = 0; i < 4; i++)
+    {
+        if (i == largest) { continue; }
+
+        float x = clampf(sign * c[i] / QUAT48_RANGE, -1.0f, 1.0f);
+        bits = (bits << 15) | (uint64_t)(int)((x * 0.5f + 0.5f) * QUAT48_LEVELS + 0.5f);
+    }
+
+    quat48 e;
+    e.v[0] = (uint16_t)(bits >> 32);
+    e.v[1] = (uint16_t)(bits >> 16);
+    e.v[2] = (uint16_t)(bits);
+    return e;
+}
+
+static inline quat quat48_decode(const quat48 e)
+{
+    uint64_t bits = ((uint64_t)e.v[0] << 32) | ((uint64_t)e.v[1] << 16) | (uint64_t)e.v[2];
+
+    int largest = (int)(bits >> 45);
+
+    float c[4];
+    float sum = 0.0f;
+    for (int i = 3; i >= 0; i--)
+    {
+        if (i == largest) { continue; }
+
+        float x = (float)(bits & 0x7FFF) / QUAT48_LEVELS;
+        c[i] = (x * 2.0f - 1.0f) * QUAT48_RANGE;
+        sum += c[i] * c[i];
+        bits >>= 15;
+    }
+
+    c[largest] = sqrtf(maxf(1.0f - sum, 0.0f));
+
+    return quat_normalize(quat(c[0], c[1], c[2], c[3]));
+}
+
+static inline vec3q vec3q_encode(const vec3 v, const vec3 min, const vec3 step)
+{
+    vec3q e;
+    e.x = (uint16_t)(step.x > 0.0f ? (int)clampf((v.x - min.x) / step.x + 0.5f, 0.0f, 65535.0f) : 0);
+    e.y = (uint16_t)(step.y > 0.0f ? (int)clampf((v.y - min.y) / step.y + 0.5f, 0.0f, 65535.0f) : 0);
+    e.z = (uint16_t)(step.z > 0.0f ? (int)clampf((v.z - min.z) / step.z + 0.5f, 0.0f, 65535.0f) : 0);
+    return e;
+}
+
+static inline vec3 vec3q_decode(const vec3q e, const vec3 min, const vec3 step)
+{
+    return vec3(
+        min.x + e.x * step.x,
+        min.y + e.y * step.y,
+        min.z + e.z * step.z);
+}
+
+// More accurate than `quat_angle_between` for the tiny 
+// angles introduced by quantization where acos is too coarse
+static inline float database_rotation_error(quat q, quat p)
+{
+    quat diff = quat_abs(quat_mul_inv(q, p));
+    return 2.0f * atan2f(sqrtf(diff.x * diff.x + diff.y * diff.y + diff.z * diff.z), diff.w);
+}
+
+void database_compress_poses(
+    database& db,
+    float& max_position_error,
+    float& max_rotation_error)
+{
+    assert(!db.paged());
+
+    max_position_error = 0.0f;
+    max_rotation_error = 0.0f;
+
+    if (db.compressed() || db.nframes() == 0)
+    {
+        return;
+    }
+
+    // Quantization range of each non-root bone
+    db.bone_positions_min.resize(db.nbones());
+    db.bone_positions_step.resize(db.nbones());
+
+    for (int b = 1; b < db.nbones(); b++)
+    {
+        vec3 bmin = db.bone_positions(0, b);
+        vec3 bmax = db.bone_positions(0, b);
+
+        for (int i = 1; i < db.nframes(); i++)
+        {
+            vec3 p = db.bone_positions(i, b);
+            bmin = vec3(minf(bmin.x, p.x), minf(bmin.y, p.y), minf(bmin.z, p.z));
+            bmax = vec3(maxf(bmax.x, p.x), maxf(bmax.y, p.y), maxf(bmax.z, p.z));
+        }
+
+        db.bone_positions_min(b) = bmin;
+        db.bone_positions_step(b) = (bmax - bmin) / 65535.0f;
+    }
+
+    db.bone_positions_min(0) = vec3();
+    db.bone_positions_step(0) = vec3();
+
+    db.bone_rotations_compressed.resize(db.nframes(), db.nbones());
+    db.bone_root_positions_compressed.resize(db.nframes());
+    db.bone_positions_compressed.resize(db.nframes(), db.nbones() - 1);
+
+    // Encode in chunks, measuring the error of each as we go
+    int nchunks = database_build_nchunks(db);
+    array1d<float> chunk_position_error(nchunks);
+    array1d<float> chunk_rotation_error(nchunks);
+
+    ParallelFor(nchunks, [&](int32 c)
+    {
+        int start = c * BUILD_CHUNK_SIZE;
+        int stop = std::min(start + BUILD_CHUNK_SIZE, db.nframes());
+
+        float position_error = 0.0f;
+        float rotation_error = 0.0f;
+
+        for (int i = start; i < stop; i++)
+        {
+            db.bone_root_positions_compressed(i) = db.bone_positions(i, 0);
+
+            for (int b = 0; b < db.nbones(); b++)
+            {
+                quat48 r = quat48_encode(db.bone_rotations(i, b));
+                db.bone_rotations_compressed(i, b) = r;
+                rotation_error = maxf(rotation_error, 
+                    database_rotation_error(quat48_decode(r), quat_normalize(db.bone_rotations(i, b))));
+
+                if (b > 0)
+                {
+                    vec3q p = vec3q_encode(db.bone_positions(i, b), db.bone_positions_min(b), db.bone_positions_step(b));
+                    db.bone_positions_compressed(i, b - 1) = p;
+                    position_error = maxf(position_error, 
+                        length(vec3q_decode(p, db.bone_positions_min(b), db.bone_positions_step(b)) - db.bone_positions(i, b)));
+                }
+            }
+        }
+
+        chunk_position_error(c) = position_error;
+        chunk_rotation_error(c) = rotation_error;
+    });
+
+    for (int c = 0; c < nchunks; c++)
+    {
+        max_position_error = maxf(max_position_error, chunk_position_error(c));
+        max_rotation_error = maxf(max_rotation_error, chunk_rotation_error(c));
+    }
+
+    db.bone_positions.resize(0, 0);
+    db.bone_rotations.resize(0, 0);
+}
+
+// If a position is outside of the quantization range of a bone, 
+// allowing for rounding to the nearest step
+static inline bool vec3q_outside(const vec3 v, const vec3 min, const vec3 step)
+{
+    vec3 max = min + 65535.0f * step;
+    return
+        v.x < min.x - 0.5f * step.x || v.x > max.x + 0.5f * step.x ||
+        v.y < min.y - 0.5f * step.y || v.y > max.y + 0.5f * step.y ||
+        v.z < min.z - 0.5f * step.z || v.z > max.z + 0.5f * step.z;
+}
+
+// Quantize the poses of a clip appended to a compressed database
+// within the existing position ranges, leaving the frames already
+// stored as they are rather than compounding their error. Bones 
+// which the clip takes outside of their range, which is rare as the
+// bones other than the root keep to their lengths, have the range
+// widened and their stored frames quantized again. Outputs the 
+// largest error introduced, including that added to those frames.
+static void database_compress_append(
+    database& db,
+    const database& clip,
+    float& max_position_error,
+    float& max_rotation_error)
+{
+    int start = db.nframes();
+    int stop = start + clip.nframes();
+
+    max_position_error = 0.0f;
+    max_rotation_error = 0.0f;
+
+    db.bone_rotations_compressed.resize(stop, db.nbones());
+    db.bone_root_positions_compressed.resize(stop);
+    db.bone_positions_compressed.resize(stop, db.nbones() - 1);
+
+    for (int b = 1; b < db.nbones(); b++)
+    {
+        vec3 min = db.bone_positions_min(b);
+        vec3 step = db.bone_positions_step(b);
+
+        bool outside = false;
+        vec3 bmin = min;
+        vec3 bmax = min + 65535.0f * step;
+
+        for (int i = 0; i < clip.nframes(); i++)
+        {
+            vec3 p = clip.bone_positions(i, b);
+            outside = outside || vec3q_outside(p, min, step);
+            bmin = vec3(minf(bmin.x, p.x), minf(bmin.y, p.y), minf(bmin.z, p.z));
+            bmax = vec3(maxf(bmax.x, p.x), maxf(bmax.y, p.y), maxf(bmax.z, p.z));
+        }
+
+        if (!outside)
+        {
+            continue;
+        }
+
+        db.bone_positions_min(b) = bmin;
+        db.bone_positions_step(b) = (bmax - bmin) / 65535.0f;
+
+        for (int i = 0; i < start; i++)
+        {
+            vec3 p = vec3q_decode(db.bone_positions_compressed(i, b - 1), min, step);
+            vec3q e = vec3q_encode(p, db.bone_positions_min(b), db.bone_positions_step(b));
+            db.bone_positions_compressed(i, b - 1) = e;
+            max_position_error = maxf(max_position_error,
+                length(vec3q_decode(e, db.bone_positions_min(b), db.bone_positions_step(b)) - p));
+        }
+    }
+
+    for (int i = start; i < stop; i++)
+    {
+        db.bone_root_positions_compressed(i) = clip.bone_positions(i - start, 0);
+
+        for (int b = 0; b < db.nbones(); b++)
+        {
+            quat48 r = quat48_encode(clip.bone_rotations(i - start, b));
+            db.bone_rotations_compressed(i, b) = r;
+            max_rotation_error = maxf(max_rotation_error,
+                database_rotation_error(quat48_decode(r), quat_normalize(clip.bone_rotations(i - start, b))));
+
+            if (b > 0)
+            {
+                vec3q p = vec3q_encode(clip.bone_positions(i - start, b), db.bone_positions_min(b), db.bone_positions_step(b));
+                db.bone_positions_compressed(i, b - 1) = p;
+                max_position_error = maxf(max_position_error,
+                    length(vec3q_decode(p, db.bone_positions_min(b), db.bone_positions_step(b)) - clip.bone_positions(i - start, b)));
+            }
+        }
+    }
+}
+
+void database_decompress_poses(database& db)
+{
+    if (!db.compressed())
+    {
+        return;
+    }
+
+    db.bone_positions.resize(db.nframes(), db.nbones());
+    db.bone_rotations.resize(db.nframes(), db.nbones());
+
+    ParallelFor(database_build_nchunks(db), [&](int32 c)
+    {
+        int start = c * BUILD_CHUNK_SIZE;
+        int stop = std::min(start + BUILD_CHUNK_SIZE, db.nframes());
+
+        for (int i = start; i < stop; i++)
+        {
+            database_pose(
+                db.bone_positions(i),
+                slice1d<vec3>(0, NULL),
+                db.bone_rotations(i),
+                slice1d<vec3>(0, NULL),
+                db, i);
+        }
+    });
+
+    db.bone_rotations_compressed.resize(0, 0);
+    db.bone_root_positions_compressed.resize(0);
+    db.bone_positions_compressed.resize(0, 0);
+    db.bone_positions_min.resize(0);
+    db.bone_positions_step.resize(0);
+}
+
+static inline vec3 database_bone_position(const database& db, const int frame, const int bone)
+{
+    if (!db.compressed())
+    {
+        return db.bone_positions(frame, bone);
+    }
+
+    return bone == 0 ? db.bone_root_positions_compressed(frame) :
+        vec3q_decode(db.bone_positions_compressed(frame, bone - 1), db.bone_positions_min(bone), db.bone_positions_step(bone));
+}
+
+static inline quat database_bone_rotation(const database& db, const int frame, const int bone)
+{
+    return db.compressed() ? quat48_decode(db.bone_rotations_compressed(frame, bone)) : db.bone_rotations(frame, bone);
+}
+
+//---------------------------------------------------------------
+// Velocities are reconstructed the same way the exporter computes
+// them: central differences for frames inside a range, 
+// and extrapolation of the neighbouring velocities for the first 
+// and last frames of the range (using the exporter's exact, if 
+// slightly asymmetric, formulas for each end).
+static inline void database_central_velocity(
+    vec3& bone_velocity,
+    vec3& bone_angular_velocity,
+    const database& db,
+    const int frame,
+    const int bone)
+{
+    vec3 p0 = database_bone_position(db, frame - 1, bone);
+    vec3 p1 = database_bone_position(db, frame, bone);
+    vec3 p2 = database_bone_position(db, frame + 1, bone);
+
+    quat r0 = database_bone_rotation(db, frame - 1, bone);
+    quat r1 = database_bone_rotation(db, frame, bone);
+    quat r2 = database_bone_rotation(db, frame + 1, bone);
+
+    float dt = 1.0f / db.frame_rate;
+
+    bone_velocity = 0.5f * ((p2 - p1) / dt) + 0.5f * ((p1 - p0) / dt);
+    bone_angular_velocity = 
+        0.5f * quat_to_scaled_angle_axis(quat_abs(quat_mul_inv(r2, r1))) / dt + 
+        0.5f * quat_to_scaled_angle_axis(quat_abs(quat_mul_inv(r1, r0))) / dt;
+}
+
+static inline void database_derive_velocity(
+    vec3& bone_velocity,
+    vec3& bone_angular_velocity,
+    const database& db,
+    const int frame,
+    const int bone)
+{
+    int range = db.frame_ranges(frame);
+    int start = range != -1 ? db.range_starts(range) : frame;
+    int stop = range != -1 ? db.range_stops(range) : frame + 1;
+
+    if (frame > start && frame < stop - 1)
+    {
+        database_central_velocity(bone_velocity, bone_angular_velocity, db, frame, bone);
+    }
+    else if (stop - start >= 5 && frame == start)
+    {
+        vec3 v1, v2, v3, a1, a2, a3;
+        database_central_velocity(v1, a1, db, start + 1, bone);
+        database_central_velocity(v2, a2, db, start + 2, bone);
+        database_central_velocity(v3, a3, db, start + 3, bone);
+
+        bone_velocity = v1 - (v3 - v2);
+        bone_angular_velocity = a1 - (a3 - a2);
+    }
+    else if (stop - start >= 5)
+    {
+        vec3 v2, v3, a2, a3;
+        database_central_velocity(v2, a2, db, stop - 2, bone);
+        database_central_velocity(v3, a3, db, stop - 3, bone);
+
+        bone_velocity = v2 + (v2 - v3);
+        bone_angular_velocity = a2 + (a2 - a3);
+    }
+    else if (stop - start >= 2)
+    {
+        // Too short to extrapolate so use a one sided difference
+        int prev = frame == start ? frame : frame - 1;
+        int next = prev + 1;
+        float dt = 1.0f / db.frame_rate;
+
+        bone_velocity = (database_bone_position(db, next, bone) - database_bone_position(db, prev, bone)) / dt;
+        bone_angular_velocity = quat_differentiate_angular_velocity(
+            database_bone_rotation(db, next, bone), database_bone_rotation(db, prev, bone), dt);
+    }
+    else
+    {
+        bone_velocity = vec3();
+        bone_angular_velocity = vec3();
+    }
+}
+
+//---------------------------------------------------------------
+// Mirroring across the x axis. Rotations and angular velocities 
+// are pseudo vectors so flip the opposite components to positions 
+// and velocities.
+static inline vec3 database_mirror_vector(const vec3 v) { return vec3(-v.x, v.y, v.z); }
+static inline vec3 database_mirror_pseudo_vector(const vec3 v) { return vec3(v.x, -v.y, -v.z); }
+static inline quat database_mirror_rotation(const quat q) { return quat(q.w, q.x, -q.y, -q.z); }
+
+template<typename T>
+static void database_mirror_bones(slice1d<T> values, const slice1d<int> bone_mirrors, T (*mirror)(const T))
+{
+    if (values.size == 0)
+    {
+        return;
+    }
+
+    array1d<T> source = values;
+    for (int b = 0; b < values.size; b++)
+    {
+        values(b) = mirror(source(bone_mirrors(b)));
+    }
+}
+
+// Mirror a pose in place, each bone taking the mirror of the 
+// transform of the bone on the other side
+static void database_mirror_pose(
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const database& db)
+{
+    assert(db.mirrored());
+
+    database_mirror_bones(bone_positions, db.bone_mirrors, database_mirror_vector);
+    database_mirror_bones(bone_velocities, db.bone_mirrors, database_mirror_vector);
+    database_mirror_bones(bone_rotations, db.bone_mirrors, database_mirror_rotation);
+    database_mirror_bones(bone_angular_velocities, db.bone_mirrors, database_mirror_pseudo_vector);
+}
+
+// Mirror of each feature dimension of the schema. Bone channels map
+// to the channel of the mirrored bone, or to themselves if there is
+// none such as for the hips, and trajectory channels to themselves. 
+// The x component of every channel flips sign.
+static void database_build_feature_mirrors(database& db)
+{
+    if (!db.mirrored())
+    {
+        db.feature_mirrors.resize(0);
+        db.feature_mirror_signs.resize(0);
+        return;
+    }
+
+    db.feature_mirrors.resize(db.schema.nfeatures());
+    db.feature_mirror_signs.resize(db.schema.nfeatures());
+
+    int offset = 0;
+    for (int c = 0; c < db.schema.nchannels(); c++)
+    {
+        const feature_channel& channel = db.schema.channels(c);
+        bool bone_channel = channel.type == FEATURE_BONE_POSITION || channel.type == FEATURE_BONE_VELOCITY;
+
+        int mirror_offset = offset;
+        if (bone_channel)
+        {
+            int found_offset = 0;
+            if (feature_schema_find(found_offset, db.schema, channel.type, db.bone_mirrors(channel.bone)) != -1)
+            {
+                mirror_offset = found_offset;
+            }
+        }
+
+        for (int k = 0; k < channel.size(); k++)
+        {
+            db.feature_mirrors(offset + k) = mirror_offset + k;
+            db.feature_mirror_signs(offset + k) = k % (bone_channel ? 3 : 2) == 0 ? -1.0f : 1.0f;
+        }
+
+        offset += channel.size();
+    }
+}
+
+void database_mirror(database& db, const slice1d<int> contact_bones)
+{
+    assert(contact_bones.size == db.ncontacts());
+
+    db.bone_mirrors.resize(db.nbones());
+    for (int b = 0; b < db.nbones(); b++)
+    {
+        db.bone_mirrors(b) = bone_mirror(b);
+    }
+
+    db.contact_mirrors.resize(db.ncontacts());
+    for (int c = 0; c < db.ncontacts(); c++)
+    {
+        db.contact_mirrors(c) = c;
+        for (int m = 0; m < db.ncontacts(); m++)
+        {
+            if (contact_bones(m) == bone_mirror(contact_bones(c)))
+            {
+                db.contact_mirrors(c) = m;
+            }
+        }
+    }
+
+    database_build_feature_mirrors(db);
+}
+
+// Normalized feature of a frame, which may be mirrored
+static inline float database_feature(const database& db, const int frame, const int j)
+{
+    return frame < db.nframes() ? db.features(frame, j) :
+        db.feature_mirror_signs(j) * db.features(frame - db.nframes(), db.feature_mirrors(j));
+}
+
+void database_features(slice1d<float> features, const database& db, const int frame)
+{
+    for (int j = 0; j < db.nfeatures(); j++)
+    {
+        features(j) = database_feature(db, frame, j);
+    }
+}
+
+// Swap the bits of the contacts of mirrored bones
+static inline uint32_t database_contact_mask_mirror(const database& db, const uint32_t mask)
+{
+    uint32_t mirrored = 0;
+    for (int c = 0; c < db.ncontacts(); c++)
+    {
+        mirrored |= ((mask >> db.contact_mirrors(c)) & 1) << c;
+    }
+
+    return mirrored;
+}
+
+uint32_t database_contact_mask(const database& db, const int frame)
+{
+    return frame < db.nframes() ? contact_bits_get(db.contact_bits, db.ncontacts(), frame) :
+        database_contact_mask_mirror(db, contact_bits_get(db.contact_bits, db.ncontacts(), frame - db.nframes()));
+}
+
+void database_contacts(slice1d<bool> contacts, const database& db, const int frame)
+{
+    uint32_t mask = database_contact_mask(db, frame);
+    for (int c = 0; c < db.ncontacts(); c++)
+    {
+        contacts(c) = (mask >> c) & 1;
+    }
+}
+
+//---------------------------------------------------------------
+// Empty outputs are skipped so only the parts needed are decoded
+bool database_pose(
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const database& db,
+    const int frame)
+{
+    assert(bone_positions.size == 0 || bone_positions.size == db.nbones());
+    assert(bone_velocities.size == 0 || bone_velocities.size == db.nbones());
+    assert(bone_rotations.size == 0 || bone_rotations.size == db.nbones());
+    assert(bone_angular_velocities.size == 0 || bone_angular_velocities.size == db.nbones());
+
+    if (frame >= db.nframes())
+    {
+        if (!database_pose(bone_positions, bone_velocities, bone_rotations, bone_angular_velocities, db, frame - db.nframes()))
+        {
+            return false;
+        }
 
-    assert(offset == nfeatures);
+        database_mirror_pose(bone_positions, bone_velocities, bone_rotations, bone_angular_velocities, db);
+        return true;
+    }
 
-    database_build_bounds(db);
+    if (db.paged())
+    {
+        return pose_pager_read(*db.pager, bone_positions, bone_velocities, bone_rotations, bone_angular_velocities, db.frame_ranges(frame), frame);
+    }
+
+    if (!db.velocities_derived())
+    {
+        if (bone_velocities.size > 0)
+        {
+            memcpy(bone_velocities.data, &db.bone_velocities(frame, 0), db.nbones() * sizeof(vec3));
+        }
+
+        if (bone_angular_velocities.size > 0)
+        {
+            memcpy(bone_angular_velocities.data, &db.bone_angular_velocities(frame, 0), db.nbones() * sizeof(vec3));
+        }
+    }
+    else if (bone_velocities.size > 0 || bone_angular_velocities.size > 0)
+    {
+        for (int b = 0; b < db.nbones(); b++)
+        {
+            vec3 bone_velocity, bone_angular_velocity;
+            database_derive_velocity(bone_velocity, bone_angular_velocity, db, frame, b);
+
+            if (bone_velocities.size > 0) { bone_velocities(b) = bone_velocity; }
+            if (bone_angular_velocities.size > 0) { bone_angular_velocities(b) = bone_angular_velocity; }
+        }
+    }
+
+    if (!db.compressed())
+    {
+        if (bone_positions.size > 0)
+        {
+            memcpy(bone_positions.data, &db.bone_positions(frame, 0), db.nbones() * sizeof(vec3));
+        }
+
+        if (bone_rotations.size > 0)
+        {
+            memcpy(bone_rotations.data, &db.bone_rotations(frame, 0), db.nbones() * sizeof(quat));
+        }
+
+        return true;
+    }
+
+    if (bone_positions.size > 0)
+    {
+        for (int b = 0; b < db.nbones(); b++)
+        {
+            bone_positions(b) = database_bone_position(db, frame, b);
+        }
+    }
+
+    if (bone_rotations.size > 0)
+    {
+        for (int b = 0; b < db.nbones(); b++)
+        {
+            bone_rotations(b) = database_bone_rotation(db, frame, b);
+        }
+    }
+
+    return true;
+}
+
+static inline void database_bone_velocity(
+    vec3& bone_velocity,
+    vec3& bone_angular_velocity,
+    const database& db,
+    const int frame,
+    const int bone)
+{
+    if (db.velocities_derived())
+    {
+        database_derive_velocity(bone_velocity, bone_angular_velocity, db, frame, bone);
+    }
+    else
+    {
+        bone_velocity = db.bone_velocities(frame, bone);
+        bone_angular_velocity = db.bone_angular_velocities(frame, bone);
+    }
+}
+
+bool database_pose_interpolated(
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const database& db,
+    const int frame,
+    const float alpha)
+{
+    if (frame >= db.nframes())
+    {
+        if (!database_pose_interpolated(bone_positions, bone_velocities, bone_rotations, bone_angular_velocities, db, frame - db.nframes(), alpha))
+        {
+            return false;
+        }
+
+        database_mirror_pose(bone_positions, bone_velocities, bone_rotations, bone_angular_velocities, db);
+        return true;
+    }
+
+    int next = database_trajectory_index_clamp(db, frame, 1);
+
+    if (alpha <= 0.0f || next == frame)
+    {
+        return database_pose(bone_positions, bone_velocities, bone_rotations, bone_angular_velocities, db, frame);
+    }
+
+    if (db.paged())
+    {
+        // Both frames are in the same range so are read from the same page
+        return pose_pager_read_interpolated(*db.pager, bone_positions, bone_velocities, bone_rotations, bone_angular_velocities, db.frame_ranges(frame), frame, next, alpha);
+    }
+
+    for (int b = 0; b < db.nbones(); b++)
+    {
+        if (bone_positions.size > 0)
+        {
+            bone_positions(b) = lerp(
+                database_bone_position(db, frame, b),
+                database_bone_position(db, next, b), alpha);
+        }
+
+        if (bone_rotations.size > 0)
+        {
+            bone_rotations(b) = quat_nlerp_shortest(
+                database_bone_rotation(db, frame, b),
+                database_bone_rotation(db, next, b), alpha);
+        }
+
+        if (bone_velocities.size > 0 || bone_angular_velocities.size > 0)
+        {
+            vec3 velocity0, velocity1, angular_velocity0, angular_velocity1;
+            database_bone_velocity(velocity0, angular_velocity0, db, frame, b);
+            database_bone_velocity(velocity1, angular_velocity1, db, next, b);
+
+            if (bone_velocities.size > 0) { bone_velocities(b) = lerp(velocity0, velocity1, alpha); }
+            if (bone_angular_velocities.size > 0) { bone_angular_velocities(b) = lerp(angular_velocity0, angular_velocity1, alpha); }
+        }
+    }
+
+    return true;
+}
+
+void database_drop_velocities(database& db)
+{
+    assert(!db.paged());
+    assert(db.frame_ranges.size == db.nframes());
+
+    db.bone_velocities.resize(0, 0);
+    db.bone_angular_velocities.resize(0, 0);
+}
+
+void database_page_poses(database& db, pose_pager& pager)
+{
+    assert(!db.compressed() && !db.paged());
+    assert(pager.nbones == db.nbones() && pager.pages.size == db.nranges());
+    assert(db.frame_ranges.size == db.nframes());
+
+    db.bone_positions.resize(0, 0);
+    db.bone_velocities.resize(0, 0);
+    db.bone_rotations.resize(0, 0);
+    db.bone_angular_velocities.resize(0, 0);
+
+    // Resizing an array viewing a file to its own size copies it
+    db.bone_parents.resize(db.bone_parents.size);
+    db.range_starts.resize(db.range_starts.size);
+    db.range_stops.resize(db.range_stops.size);
+    db.pager = &pager;
+}
+
+void database_prefetch(const database& db, const int frame)
+{
+    int source = frame >= db.nframes() ? frame - db.nframes() : frame;
+
+    if (db.paged() && source >= 0 && source < db.nframes())
+    {
+        pose_pager_prefetch(*db.pager, db.frame_ranges(source));
+    }
 }
 
+//---------------------------------------------------------------
+// Compute the lower bound of the query distance for a block 
+// of BOUND_BLOCK_SIZE consecutive boxes and return a bitmask of 
+// the boxes which have a lower bound less than `best_cost`. Since
+// the bounds are stored dimension-major the inner loop runs over
+// contiguous boxes and compiles to SIMD.
+unsigned int motion_matching_bounds_block(
+    float* __restrict block_costs,
+    const slice2d<float> bound_min,
+    const slice2d<float> bound_max,
+    const slice1d<float> query_normalized,
+    const int block,
+    const float transition_cost,
+    const float best_cost)
+{
+    for (int k = 0; k < BOUND_BLOCK_SIZE; k++)
+    {
+        block_costs[k] = transition_cost;
+    }
+
+    for (int j = 0; j < query_normalized.size; j++)
+    {
+        const float query = query_normalized(j);
+        const float* __restrict block_min = &bound_min(j, block * BOUND_BLOCK_SIZE);
+        const float* __restrict block_max = &bound_max(j, block * BOUND_BLOCK_SIZE);
+
+        for (int k = 0; k < BOUND_BLOCK_SIZE; k++)
+        {
+            block_costs[k] += squaref(query - minf(maxf(query, block_min[k]), block_max[k]));
+        }
+    }
+
+    unsigned int block_mask = 0;
+    for (int k = 0; k < BOUND_BLOCK_SIZE; k++)
+    {
+        block_mask |= (block_costs[k] < best_cost ? 1u : 0u) << k;
+    }
+
+    return block_mask;
+}
 
 //---------------------------------------------------------------
 // Motion Matching search function essentially consists
 // of comparing every feature vector in the database, 
 // against the query feature vector, first checking the 
 // query distance to the axis aligned bounding boxes used 
-// for the acceleration structure.
-void motion_matching_search(
+// for the acceleration structure. The traversal starts from
+// the given range and slot and stops once `work` reaches 
+// `work_budget`, storing where it got to so that it can be 
+// continued later. Returns true once the whole database has
+// been visited.
+bool motion_matching_search(
     int& __restrict best_index,
     float& __restrict best_cost,
+    int& __restrict range_cursor,
+    int& __restrict slot_cursor,
+    int& __restrict work,
+    const int curr_index,
     const slice1d<int> range_starts,
     const slice1d<int> range_stops,
+    const slice1d<int> search_order,
+    const slice1d<bool> searchable,
+    const slice1d<uint64_t> contact_bits,
+    const int ncontacts,
+    const uint32_t contact_filter,
     const slice2d<float> features,
     const slice1d<float> features_offset,
     const slice1d<float> features_scale,
@@ -567,53 +2420,62 @@ void motion_matching_search(
     const slice1d<float> query_normalized,
     const float transition_cost,
     const int ignore_range_end,
-    const int ignore_surrounding)
+    const int ignore_surrounding,
+    const int work_budget)
 {
-    int nfeatures = query_normalized.size;
-    int nranges = range_starts.size;
+    int nfeatures = (int)query_normalized.size;
+    int nranges = (int)range_starts.size;
 
-    int curr_index = best_index;
+    float curr_cost = 0.0f;
 
-    // Find cost for current frame
-    if (best_index != -1)
-    {
-        best_cost = 0.0;
-        for (int i = 0; i < nfeatures; i++)
-        {
-            best_cost += squaref(query_normalized(i) - features(best_index, i));
-        }
-    }
+    // Lower bounds and masks for the block of boxes which 
+    // contains the box currently being visited at each level
+    int lr_block = -1;
+    unsigned int lr_mask = 0;
+    float lr_costs[BOUND_BLOCK_SIZE];
 
-    float curr_cost = 0.0f;
+    int sm_block = -1;
+    unsigned int sm_mask = 0;
+    float sm_costs[BOUND_BLOCK_SIZE];
 
     // Search rest of database
-    for (int r = 0; r < nranges; r++)
+    for (int r = range_cursor; r < nranges; r++)
     {
-        // Exclude end of ranges from search    
-        int i = range_starts(r);
-        int range_end = range_stops(r) - ignore_range_end;
+        // Exclude end of ranges from search. When the frames are
+        // reordered the end of the range can be in any slot so we
+        // need to visit them all and check each frame instead.
+        int i = r == range_cursor ? slot_cursor : range_starts(r);
+        int frame_end = range_stops(r) - ignore_range_end;
+        int range_end = search_order.size > 0 ? range_stops(r) : frame_end;
 
         while (i < range_end)
         {
+            // Out of budget so remember where we got to
+            if (work >= work_budget)
+            {
+                range_cursor = r;
+                slot_cursor = i;
+                return false;
+            }
+
             // Find index of current and next large box
             int i_lr = i / BOUND_LR_SIZE;
             int i_lr_next = (i_lr + 1) * BOUND_LR_SIZE;
 
-            // Find distance to box
-            curr_cost = transition_cost;
-            for (int j = 0; j < nfeatures; j++)
-            {
-                curr_cost += squaref(query_normalized(j) - clampf(query_normalized(j),
-                    bound_lr_min(i_lr, j), bound_lr_max(i_lr, j)));
+            work++;
 
-                if (curr_cost >= best_cost)
-                {
-                    break;
-                }
+            // Find distance to all boxes in the block if not done already
+            if (i_lr / BOUND_BLOCK_SIZE != lr_block)
+            {
+                lr_block = i_lr / BOUND_BLOCK_SIZE;
+                lr_mask = motion_matching_bounds_block(lr_costs, bound_lr_min, bound_lr_max,
+                    query_normalized, lr_block, transition_cost, best_cost);
+                work += BOUND_BLOCK_SIZE;
             }
 
             // If distance is greater than current best jump to next box
-            if (curr_cost >= best_cost)
+            int k_lr = i_lr % BOUND_BLOCK_SIZE;
+            if (!(lr_mask & (1u << k_lr)) || lr_costs[k_lr] >= best_cost)
             {
                 i = i_lr_next;
                 continue;
@@ -626,21 +2488,18 @@ void motion_matching_search(
                 int i_sm = i / BOUND_SM_SIZE;
                 int i_sm_next = (i_sm + 1) * BOUND_SM_SIZE;
 
-                // Find distance to box
-                curr_cost = transition_cost;
-                for (int j = 0; j < nfeatures; j++)
+                // Find distance to all boxes in the block if not done already
+                if (i_sm / BOUND_BLOCK_SIZE != sm_block)
                 {
-                    curr_cost += squaref(query_normalized(j) - clampf(query_normalized(j),
-                        bound_sm_min(i_sm, j), bound_sm_max(i_sm, j)));
-
-                    if (curr_cost >= best_cost)
-                    {
-                        break;
-                    }
+                    sm_block = i_sm / BOUND_BLOCK_SIZE;
+                    sm_mask = motion_matching_bounds_block(sm_costs, bound_sm_min, bound_sm_max,
+                        query_normalized, sm_block, transition_cost, best_cost);
+                    work += BOUND_BLOCK_SIZE;
                 }
 
                 // If distance is greater than current best jump to next box
-                if (curr_cost >= best_cost)
+                int k_sm = i_sm % BOUND_BLOCK_SIZE;
+                if (!(sm_mask & (1u << k_sm)) || sm_costs[k_sm] >= best_cost)
                 {
                     i = i_sm_next;
                     continue;
@@ -649,8 +2508,12 @@ void motion_matching_search(
                 // Search inside small box
                 while (i < i_sm_next && i < range_end)
                 {
-                    // Skip surrounding frames
-                    if (curr_index != -1 && abs(i - curr_index) < ignore_surrounding)
+                    int frame = search_order.size > 0 ? search_order(i) : i;
+
+                    // Skip end of range, surrounding, pruned and filtered out frames
+                    if (frame >= frame_end || (curr_index != -1 && abs(frame - curr_index) < ignore_surrounding) ||
+                        (searchable.size > 0 && !searchable(frame)) ||
+                        (contact_filter != 0 && !(contact_bits_get(contact_bits, ncontacts, frame) & contact_filter)))
                     {
                         i++;
                         continue;
@@ -660,7 +2523,7 @@ void motion_matching_search(
                     curr_cost = transition_cost;
                     for (int j = 0; j < nfeatures; j++)
                     {
-                        curr_cost += squaref(query_normalized(j) - features(i, j));
+                        curr_cost += squaref(query_normalized(j) - features(frame, j));
                         if (curr_cost >= best_cost)
                         {
                             break;
@@ -670,15 +2533,169 @@ void motion_matching_search(
                     // If cost is lower than current best then update best
                     if (curr_cost < best_cost)
                     {
-                        best_index = i;
+                        best_index = frame;
                         best_cost = curr_cost;
                     }
 
+                    work++;
                     i++;
                 }
             }
         }
     }
+
+    range_cursor = nranges;
+    slot_cursor = 0;
+    return true;
+}
+
+
+//---------------------------------------------------------------
+// Start a search of the database which can be continued over
+// several calls to `database_search_continue`.
+void database_search_begin(
+    database_search_cursor& cursor,
+    const database& db,
+    const slice1d<float> query,
+    const int curr_index,
+    const float best_cost,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    const uint32_t contact_filter)
+{
+    // Normalize Query
+    cursor.query_normalized.resize(db.nfeatures());
+    for (int i = 0; i < db.nfeatures(); i++)
+    {
+        cursor.query_normalized(i) = (query(i) - db.features_offset(i)) / db.features_scale(i);
+    }
+
+    cursor.range = 0;
+    cursor.slot = db.nranges() > 0 ? db.range_starts(0) : 0;
+    cursor.curr_index = curr_index;
+    cursor.best_index = -1;
+    cursor.best_cost = best_cost;
+    cursor.transition_cost = transition_cost;
+    cursor.ignore_range_end = ignore_range_end;
+    cursor.ignore_surrounding = ignore_surrounding;
+    cursor.contact_filter = contact_filter;
+    cursor.done = false;
+    cursor.mirrored = false;
+
+    // Mirroring the query is the same as mirroring the frames since
+    // the mirror is its own inverse and leaves distances unchanged
+    if (db.mirrored())
+    {
+        cursor.query_mirrored.resize(db.nfeatures());
+        for (int i = 0; i < db.nfeatures(); i++)
+        {
+            cursor.query_mirrored(i) = db.feature_mirror_signs(i) * cursor.query_normalized(db.feature_mirrors(i));
+        }
+    }
+
+    // Find cost for current frame. The incoming best cost acts as 
+    // an upper bound, so if the current frame is not below it we 
+    // drop it and only report frames which beat the bound.
+    if (curr_index != -1)
+    {
+        float curr_frame_cost = 0.0f;
+        for (int i = 0; i < db.nfeatures(); i++)
+        {
+            curr_frame_cost += squaref(cursor.query_normalized(i) - database_feature(db, curr_index, i));
+        }
+
+        if (curr_frame_cost < cursor.best_cost)
+        {
+            cursor.best_index = curr_index;
+            cursor.best_cost = curr_frame_cost;
+        }
+    }
+}
+
+
+//---------------------------------------------------------------
+// Continue a search for at most `work_budget` units of work 
+// (roughly one per feature vector or box compared) or 
+// `time_budget` seconds if positive.
+bool database_search_continue(
+    database_search_cursor& cursor,
+    const database& db,
+    const int work_budget,
+    const double time_budget)
+{
+    double start_time = time_budget > 0.0 ? FPlatformTime::Seconds() : 0.0;
+
+    int work = 0;
+    while (!cursor.done && work < work_budget)
+    {
+        // When we have a time budget check the clock 
+        // after every SEARCH_TIME_CHECK_WORK units of work
+        int work_limit = time_budget > 0.0 ? 
+            work + std::min(work_budget - work, (int)SEARCH_TIME_CHECK_WORK) : work_budget;
+
+        // Frames on the other side of the mirror from the current 
+        // one are not near it so none of them are ignored
+        int curr_index = cursor.curr_index;
+        if (cursor.mirrored)
+        {
+            curr_index = curr_index >= db.nframes() ? curr_index - db.nframes() : -1;
+        }
+        else if (curr_index >= db.nframes())
+        {
+            curr_index = -1;
+        }
+
+        float best_cost = cursor.best_cost;
+
+        cursor.done = motion_matching_search(
+            cursor.best_index,
+            cursor.best_cost,
+            cursor.range,
+            cursor.slot,
+            work,
+            curr_index,
+            db.range_starts,
+            db.range_stops,
+            db.search_order,
+            db.searchable,
+            db.contact_bits,
+            db.ncontacts(),
+            cursor.mirrored ? database_contact_mask_mirror(db, cursor.contact_filter) : cursor.contact_filter,
+            db.features,
+            db.features_offset,
+            db.features_scale,
+            db.bound_sm_min,
+            db.bound_sm_max,
+            db.bound_lr_min,
+            db.bound_lr_max,
+            cursor.mirrored ? cursor.query_mirrored : cursor.query_normalized,
+            cursor.transition_cost,
+            cursor.ignore_range_end,
+            cursor.ignore_surrounding,
+            work_limit);
+
+        // Frames found on the second pass are mirrored ones
+        if (cursor.mirrored && cursor.best_cost < best_cost)
+        {
+            cursor.best_index += db.nframes();
+        }
+
+        if (cursor.done && !cursor.mirrored && db.mirrored())
+        {
+            cursor.mirrored = true;
+            cursor.done = false;
+            cursor.range = 0;
+            cursor.slot = db.nranges() > 0 ? db.range_starts(0) : 0;
+        }
+
+        if (time_budget > 0.0 && FPlatformTime::Seconds() - start_time >= time_budget)
+        {
+            break;
+        }
+    }
+
+    return cursor.done;
 }
 
 
@@ -691,30 +2708,214 @@ void database_search(
     const slice1d<float> query,
     const float transition_cost = 0.0f,
     const int ignore_range_end = 20,
-    const int ignore_surrounding = 20)
+    const int ignore_surrounding = 20,
+    const uint32_t contact_filter = 0)
 {
-    // Normalize Query
-    array1d<float> query_normalized(db.nfeatures());
-    for (int i = 0; i < db.nfeatures(); i++)
-    {
-        query_normalized(i) = (query(i) - db.features_offset(i)) / db.features_scale(i);
-    }
+    database_search_cursor cursor;
 
-    // Search
-    motion_matching_search(
+    database_search_begin(
+        cursor,
+        db,
+        query,
         best_index,
         best_cost,
-        db.range_starts,
-        db.range_stops,
-        db.features,
-        db.features_offset,
-        db.features_scale,
-        db.bound_sm_min,
-        db.bound_sm_max,
-        db.bound_lr_min,
-        db.bound_lr_max,
-        query_normalized,
         transition_cost,
         ignore_range_end,
-        ignore_surrounding);
-}
\ No newline at end of file
+        ignore_surrounding,
+        contact_filter);
+
+    database_search_continue(cursor, db, INT_MAX, 0.0);
+
+    best_index = cursor.best_index;
+    best_cost = cursor.best_cost;
+}
+
+
+//---------------------------------------------------------------
+// Cost of the best match found for each query by a full search
+static void database_replay_queries(
+    slice1d<float> costs,
+    const database& db,
+    const slice2d<float> queries,
+    const int ignore_range_end,
+    const int ignore_surrounding)
+{
+    ParallelFor(queries.rows, [&](int32 q)
+    {
+        int best_index = -1;
+        float best_cost = FLT_MAX;
+
+        database_search(
+            best_index,
+            best_cost,
+            db,
+            queries(q),
+            0.0f,
+            ignore_range_end,
+            ignore_surrounding,
+            0);
+
+        costs(q) = best_cost;
+    });
+}
+
+// Number of searchable frames, excluding the ends of ranges which
+// the search never transitions to anyway
+static int database_count_searchable(const database& db, const int r, const int ignore_range_end)
+{
+    int count = 0;
+    for (int i = db.range_starts(r); i < db.range_stops(r) - ignore_range_end; i++)
+    {
+        count += db.searchable.size == 0 || db.searchable(i) ? 1 : 0;
+    }
+
+    return count;
+}
+
+// If the local poses of two frames are within tolerance for every
+// bone but the root, which is in world space
+static bool database_pose_similar(
+    const slice1d<vec3> positions,
+    const slice1d<quat> rotations,
+    const slice1d<vec3> other_positions,
+    const slice1d<quat> other_rotations,
+    const float position_tolerance,
+    const float rotation_tolerance)
+{
+    for (int b = 1; b < positions.size; b++)
+    {
+        if (length(positions(b) - other_positions(b)) > position_tolerance ||
+            database_rotation_error(rotations(b), other_rotations(b)) > rotation_tolerance)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void database_prune(
+    database& db,
+    database_prune_report& report,
+    const slice2d<float> queries,
+    const float feature_tolerance,
+    const float position_tolerance,
+    const float rotation_tolerance,
+    const int ignore_range_end,
+    const int ignore_surrounding)
+{
+    assert(!db.paged());
+    assert(queries.rows == 0 || queries.cols == db.nfeatures());
+
+    report = database_prune_report();
+
+    array1d<float> costs_before(queries.rows);
+    database_replay_queries(costs_before, db, queries, ignore_range_end, ignore_surrounding);
+
+    array1d<int> range_counts(db.nranges());
+    for (int r = 0; r < db.nranges(); r++)
+    {
+        range_counts(r) = database_count_searchable(db, r, ignore_range_end);
+        report.nframes_searchable += range_counts(r);
+    }
+
+    if (db.searchable.size == 0)
+    {
+        db.searchable.resize(db.nframes());
+        db.searchable.set(true);
+    }
+
+    array1d<bool> kept(db.nframes());
+    kept.set(false);
+
+    array1d<vec3> positions(db.nbones());
+    array1d<quat> rotations(db.nbones());
+    array1d<vec3> other_positions(db.nbones());
+    array1d<quat> other_rotations(db.nbones());
+
+    for (int r = 0; r < db.nranges(); r++)
+    {
+        for (int i = db.range_starts(r); i < db.range_stops(r) - ignore_range_end; i++)
+        {
+            if (!db.searchable(i) || kept(i))
+            {
+                continue;
+            }
+
+            // Find the nearest other searchable frame in feature space,
+            // using the tolerance as the initial bound so the boxes prune
+            // almost everything. The bounds still cover the frames pruned
+            // so far which only makes them more conservative.
+            int best_index = -1;
+            float best_cost = squaref(feature_tolerance);
+            int range_cursor = 0;
+            int slot_cursor = db.nranges() > 0 ? db.range_starts(0) : 0;
+            int work = 0;
+
+            motion_matching_search(
+                best_index,
+                best_cost,
+                range_cursor,
+                slot_cursor,
+                work,
+                i,
+                db.range_starts,
+                db.range_stops,
+                db.search_order,
+                db.searchable,
+                db.contact_bits,
+                db.ncontacts(),
+                0,
+                db.features,
+                db.features_offset,
+                db.features_scale,
+                db.bound_sm_min,
+                db.bound_sm_max,
+                db.bound_lr_min,
+                db.bound_lr_max,
+                db.features(i),
+                0.0f,
+                ignore_range_end,
+                ignore_surrounding,
+                INT_MAX);
+
+            if (best_index == -1)
+            {
+                continue;
+            }
+
+            database_pose(positions, slice1d<vec3>(0, NULL), rotations, slice1d<vec3>(0, NULL), db, i);
+            database_pose(other_positions, slice1d<vec3>(0, NULL), other_rotations, slice1d<vec3>(0, NULL), db, best_index);
+
+            if (database_pose_similar(positions, rotations, other_positions, other_rotations, position_tolerance, rotation_tolerance))
+            {
+                db.searchable(i) = false;
+                kept(best_index) = true;
+                report.nframes_pruned++;
+            }
+        }
+    }
+
+    for (int r = 0; r < db.nranges(); r++)
+    {
+        if (range_counts(r) > 0 && database_count_searchable(db, r, ignore_range_end) == 0)
+        {
+            report.nranges_pruned++;
+        }
+    }
+
+    database_build_bounds(db);
+
+    // Matches can only get worse since pruning only removes candidates
+    array1d<float> costs_after(queries.rows);
+    database_replay_queries(costs_after, db, queries, ignore_range_end, ignore_surrounding);
+
+    report.nqueries = queries.rows;
+
+    for (int q = 0; q < queries.rows; q++)
+    {
+        float increase = maxf(costs_after(q) - costs_before(q), 0.0f);
+        report.mean_cost_increase += increase / queries.rows;
+        report.max_cost_increase = maxf(report.max_cost_increase, increase);
+    }
+}
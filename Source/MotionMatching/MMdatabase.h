@@ -14,6 +14,8 @@
 
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <math.h>
 
@@ -37,8 +39,139 @@ enum
 {
     BOUND_SM_SIZE = 16,
     BOUND_LR_SIZE = 64,
+    BOUND_BLOCK_SIZE = 16,
+
+    // Number of frames processed by each task when building the
+    // database. Fixed so that the result does not depend on the 
+    // number of threads.
+    BUILD_CHUNK_SIZE = 1024,
+};
+
+//---------------------------------------------------------------
+
+enum
+{
+    FEATURE_MAX_OFFSETS = 8,
+};
+
+enum feature_channel_type
+{
+    // Position of a bone relative to the simulation/root bone
+    FEATURE_BONE_POSITION = 0,
+    // Velocity of a bone relative to the simulation/root bone
+    FEATURE_BONE_VELOCITY = 1,
+    // 2D position of the root at some number of frames in the future
+    FEATURE_TRAJECTORY_POSITION = 2,
+    // 2D facing direction of the root at some number of frames in the future
+    FEATURE_TRAJECTORY_DIRECTION = 3,
+};
+
+// One channel of the feature vector. Each channel is normalized
+// as a group with its own weight.
+struct feature_channel
+{
+    int type = FEATURE_BONE_POSITION;
+    int bone = 0;
+    int noffsets = 0;
+    int offsets[FEATURE_MAX_OFFSETS] = {};
+    float weight = 1.0f;
+
+    int size() const { return type == FEATURE_BONE_POSITION || type == FEATURE_BONE_VELOCITY ? 3 : 2 * noffsets; }
+};
+
+// Layout of the feature vector used for matching. The builder, 
+// the query and the debug drawing all follow the channels in order.
+struct feature_schema
+{
+    array1d<feature_channel> channels;
+
+    int nchannels() const { return (int)channels.size; }
+    int nfeatures() const 
+    { 
+        int size = 0;
+        for (int i = 0; i < channels.size; i++) { size += channels(i).size(); }
+        return size;
+    }
 };
 
+void feature_schema_add_bone_position(feature_schema& schema, const int bone, const float weight);
+void feature_schema_add_bone_velocity(feature_schema& schema, const int bone, const float weight);
+void feature_schema_add_trajectory_position(feature_schema& schema, const slice1d<int> offsets, const float weight);
+void feature_schema_add_trajectory_direction(feature_schema& schema, const slice1d<int> offsets, const float weight);
+
+// Find the first channel of the given type (and bone for bone 
+// channels) returning its index and offset in the feature vector,
+// or -1 if there is no such channel
+int feature_schema_find(int& offset, const feature_schema& schema, const int type, const int bone);
+
+// The standard schema of foot positions and velocities, hip 
+// velocity, and the trajectory a third, two thirds and one second
+// in the future (20, 40 and 60 frames at 60 Hz)
+void feature_schema_default(
+    feature_schema& schema,
+    const float feature_weight_foot_position,
+    const float feature_weight_foot_velocity,
+    const float feature_weight_hip_velocity,
+    const float feature_weight_trajectory_positions,
+    const float feature_weight_trajectory_directions,
+    const float frame_rate);
+
+// Rotation stored with the smallest three encoding. The index of
+// the largest component takes 2 bits and the other three take 15
+// bits each, the largest being recovered from the unit length.
+struct quat48
+{
+    uint16_t v[3];
+};
+
+// Position quantized to 16 bits per axis within a per-bone range
+struct vec3q
+{
+    uint16_t x, y, z;
+};
+
+// Contact states are packed as bits, the `ncontacts` states of each
+// frame following those of the previous one, so that the states of
+// a frame can be fetched as a mask with bit i set if contact i is.
+enum
+{
+    CONTACT_MAX = 32,
+};
+
+static inline int64_t contact_bits_words(const int nframes, const int ncontacts)
+{
+    return ((int64_t)nframes * ncontacts + 63) / 64;
+}
+
+static inline uint32_t contact_bits_get(const slice1d<uint64_t> bits, const int ncontacts, const int frame)
+{
+    if (ncontacts == 0) { return 0; }
+
+    int64_t offset = (int64_t)frame * ncontacts;
+    int64_t word = offset / 64;
+    int shift = (int)(offset % 64);
+
+    uint64_t mask = bits(word) >> shift;
+    if (shift + ncontacts > 64)
+    {
+        mask |= bits(word + 1) << (64 - shift);
+    }
+
+    return (uint32_t)(mask & ((1ull << ncontacts) - 1));
+}
+
+static inline void contact_bits_set(slice1d<uint64_t> bits, const int ncontacts, const int frame, const uint32_t mask)
+{
+    for (int c = 0; c < ncontacts; c++)
+    {
+        int64_t offset = (int64_t)frame * ncontacts + c;
+        uint64_t bit = 1ull << (offset % 64);
+        bits(offset / 64) = (mask >> c) & 1 ? bits(offset / 64) | bit : bits(offset / 64) & ~bit;
+    }
+}
+
+struct pose_pager;
+
 struct database
 {
     array2d<vec3> bone_positions;
@@ -47,25 +180,86 @@ struct database
     array2d<vec3> bone_angular_velocities;
     array1d<int> bone_parents;
 
+    // Compressed pose storage. When used `bone_positions` and 
+    // `bone_rotations` are empty and poses must be decoded with 
+    // `database_pose`. Root positions are kept at full precision
+    // and only the other bones are quantized within their range.
+    array2d<quat48> bone_rotations_compressed;
+    array1d<vec3> bone_root_positions_compressed;
+    array2d<vec3q> bone_positions_compressed;
+    array1d<vec3> bone_positions_min;
+    array1d<vec3> bone_positions_step;
+
+    // Paged pose storage. When set the four pose arrays above are 
+    // empty and each range is read in from the database file when
+    // `database_pose` first needs it. Not owned by the database.
+    pose_pager* pager = NULL;
+
     array1d<int> range_starts;
     array1d<int> range_stops;
 
+    // Index of the range containing each frame
+    array1d<int> frame_ranges;
+
+    // Rate the frames were sampled at. Not part of the database 
+    // file so it must be set after loading if it isn't 60 Hz.
+    float frame_rate = 60.0f;
+
+    feature_schema schema;
     array2d<float> features;
     array1d<float> features_offset;
     array1d<float> features_scale;
 
-    array2d<bool> contact_states;
-
+    // Order in which frames are visited by the search and grouped
+    // into bounding boxes. Entry i gives the database frame stored
+    // in search slot i. Slots are only permuted within each range
+    // so `range_starts` and `range_stops` delimit slots as well as
+    // frames. Empty when frames are searched in database order.
+    array1d<int> search_order;
+
+    // Frames the search may transition to, indexed by database frame.
+    // Frames which aren't are still played back through but are 
+    // left out of the bounds. Empty when every frame is searchable.
+    array1d<bool> searchable;
+
+    // Contact states packed with `contact_bits_set`, a bit per contact
+    // per frame. Stored unpacked in files, one bool per contact.
+    array1d<uint64_t> contact_bits;
+    int contact_count = 0;
+
+    // Virtual mirroring. When set, frames from `nframes()` up to 
+    // twice that are the mirror images across the x axis of the 
+    // frames stored, derived when read using the mirror of each 
+    // bone, contact state and feature dimension. Empty when the 
+    // database is not mirrored.
+    array1d<int> bone_mirrors;
+    array1d<int> contact_mirrors;
+    array1d<int> feature_mirrors;
+    array1d<float> feature_mirror_signs;
+
+    // Bounds are stored transposed (one row per feature dimension) 
+    // so that the bounds of consecutive boxes are contiguous and can
+    // be tested against the query many at a time. The number of 
+    // columns is padded up to a multiple of BOUND_BLOCK_SIZE.
     array2d<float> bound_sm_min;
     array2d<float> bound_sm_max;
     array2d<float> bound_lr_min;
     array2d<float> bound_lr_max;
 
-    int nframes() const { return bone_positions.rows; }
-    int nbones() const { return bone_positions.cols; }
-    int nranges() const { return range_starts.size; }
-    int nfeatures() const { return features.cols; }
-    int ncontacts() const { return contact_states.cols; }
+    // Counts of frames, bones and features each fit in 32 bits, it is 
+    // only their products which need the 64 bit sizes of the arrays.
+    // Rotations are always stored, either compressed or not, unless paged.
+    int nframes() const { return (int)(paged() ? frame_ranges.size : bone_rotations.rows > 0 ? bone_rotations.rows : bone_rotations_compressed.rows); }
+    int nbones() const { return (int)bone_parents.size; }
+    bool compressed() const { return bone_rotations_compressed.rows > 0; }
+    bool paged() const { return pager != NULL; }
+    bool mirrored() const { return bone_mirrors.size > 0; }
+    bool velocities_derived() const { return !paged() && bone_velocities.rows != nframes(); }
+    int nranges() const { return (int)range_starts.size; }
+    int nfeatures() const { return (int)features.cols; }
+    int ncontacts() const { return contact_count; }
+    int nbound_sm() const { return (nframes() + BOUND_SM_SIZE - 1) / BOUND_SM_SIZE; }
+    int nbound_lr() const { return (nframes() + BOUND_LR_SIZE - 1) / BOUND_LR_SIZE; }
 };
 
 
@@ -76,25 +270,79 @@ struct database
 void database_load(database& db, const char* filename);
 
 
-void database_save_matching_features(const database& db, const char* filename);
+// Save the pose data in the versioned format of MMformat.h, which 
+// `database_load` reads as well as the original one
+void database_save(const database& db, const char* filename);
+
+
+// Load the database from the contents of a database file already
+// in memory, such as a memory mapped file, by viewing the arrays 
+// in place rather than copying them. The memory must outlive the
+// database. Returns false if the data is truncated.
+bool database_load_mapped(database& db, const char* data, const size_t size);
+
+
+// Build the lookup from each frame to the range containing it
+// from `range_starts` and `range_stops`
+void database_build_frame_ranges(database& db);
+
+
+//---------------------------------------------------------------
+
+// Arrays of baked files store their extents in 64 bits since
+// version 3, see `ARRAY_EXTENTS_64`, and the frames left out by
+// `database_prune` are stored since version 4
+enum
+{
+    DATABASE_BAKED_MAGIC = 0x4244444d, // "MDDB"
+    DATABASE_BAKED_VERSION = 4,
+};
+
+// Continue an FNV-1a hash, starting from 0xcbf29ce484222325, over
+// `size` bytes of `data`
+uint64_t database_hash_bytes(uint64_t hash, const void* data, const size_t size);
+
+
+// Hash of everything the matching features and acceleration 
+// structure are built from: the source animation data loaded from
+// `filename`, the feature schema, whether frames are reordered and
+// the mirroring of `db`. The animation data is identified by the 
+// section checksums of files in the versioned format, see MMformat.h,
+// and by the file size and modification time otherwise, so hashing 
+// does not read the poses.
+uint64_t database_source_hash(
+    const char* filename,
+    const database& db,
+    const feature_schema& schema,
+    const bool reorder_frames);
+
+
+// Save the feature schema and built matching features, normalization, 
+// search order, bounds and searchable frames tagged with the hash of 
+// the data they were built from
+void database_save_baked(const database& db, const char* filename, const uint64_t source_hash);
+
+
+// Load feature schema, matching features, normalization, search 
+// order, bounds and searchable frames previously saved with 
+// `database_save_baked`. Returns false if the file does not exist, 
+// is truncated or was built from different data, in which case they
+// need to be rebuilt with `database_build_matching_features`.
+bool database_load_baked(database& db, const char* filename, const uint64_t source_hash);
+
+
+// Same as `database_load_baked` but viewing the arrays in place in
+// the contents of a baked file already in memory
+bool database_load_baked_mapped(database& db, const char* data, const size_t size, const uint64_t source_hash);
 
 
 // When we add an offset to a frame in the database there is a chance
 // it will go out of the relevant range so here we can clamp it to 
 // the last frame of that range.
-int database_trajectory_index_clamp(database& db, int frame, int offset);
+int database_trajectory_index_clamp(const database& db, int frame, int offset);
 
 
 
-void normalize_feature(
-    slice2d<float> features,
-    slice1d<float> features_offset,
-    slice1d<float> features_scale,
-    const int offset,
-    const int size,
-    const float weight);
-
-
 void denormalize_features(
     slice1d<float> features,
     const slice1d<float> features_offset,
@@ -162,48 +410,164 @@ void forward_kinematics_velocity_partial(
 
 
 
-// Compute a feature for the position of a bone relative to the simulation/root bone
-void compute_bone_position_feature(database& db, int& offset, int bone, float weight);
+// Permute the frames of each range in the search order so that
+// frames which are close in feature space end up in the same
+// bounding boxes. This is done by recursively splitting each range
+// along the feature dimension of largest extent at box boundaries.
+void database_reorder_frames(database& db);
 
 
-// Similar but for a bone's velocity
-void compute_bone_velocity_feature(database& db, int& offset, int bone, float weight);
+// Build the Motion Matching search acceleration structure. Here we
+// just use axis aligned bounding boxes regularly spaced at BOUND_SM_SIZE
+// and BOUND_LR_SIZE slots of the search order
+void database_build_bounds(database& db);
 
 
-// Compute the trajectory at 20, 40, and 60 frames in the future
-void compute_trajectory_position_feature(database& db, int& offset, float weight);
+// Average extent of the small bounding boxes over all feature 
+// dimensions. Smaller values mean boxes which prune more often.
+float database_bounds_mean_extent(const database& db);
 
 
-// Same for direction
-void compute_trajectory_direction_feature(database& db, int& offset, float weight);
+// Build all motion matching features described by the schema 
+// and the acceleration structure
+void database_build_matching_features(
+    database& db,
+    const feature_schema& schema,
+    const bool reorder_frames);
+
+
+// Append the ranges of another database (with the same skeleton)
+// and extend the features and bounds to cover them incrementally,
+// keeping the existing feature normalization. The poses of compressed
+// databases are quantized within the existing ranges, only for the
+// frames appended, unless they fall outside of the range of a bone 
+// which is then widened. The largest error introduced is logged.
+// Mirrored databases can't be appended to as their
+// mirrored frames are numbered after the stored ones and would all
+// be renumbered.
+void database_append(database& db, const database& clip);
+
+
+// Compress the bone positions and rotations of the database,
+// freeing the full precision ones. Rotations take 6 bytes instead
+// of 16 and non-root positions 6 bytes instead of 12. Outputs the 
+// largest error introduced in position and rotation angle.
+void database_compress_poses(
+    database& db,
+    float& max_position_error,
+    float& max_rotation_error);
 
 
-// Build the Motion Matching search acceleration structure. Here we
-// just use axis aligned bounding boxes regularly spaced at BOUND_SM_SIZE
-// and BOUND_LR_SIZE frames
-void database_build_bounds(database& db);
+// Restore full precision storage from the compressed data
+void database_decompress_poses(database& db);
 
 
-// Build all motion matching features and acceleration structure
-void database_build_matching_features(
-    database& db,
-    const float feature_weight_foot_position,
-    const float feature_weight_foot_velocity,
-    const float feature_weight_hip_velocity,
-    const float feature_weight_trajectory_positions,
-    const float feature_weight_trajectory_directions);
+// Free the stored bone velocities and angular velocities. From then
+// on they are derived from the positions and rotations of the frames
+// around the one being read, using the same central differences as
+// the exporter, so long as `frame_ranges` has been built.
+void database_drop_velocities(database& db);
+
+
+// Page the pose data in per range from the database file through 
+// an opened pager instead of keeping it in memory, freeing the pose
+// arrays. Features, bounds and everything else stay resident, and
+// no longer view the database file so it can be unmapped.
+void database_page_poses(database& db, pose_pager& pager);
+
+
+// Mirror the database virtually, doubling the frames which can be 
+// searched and played back without storing any more of them. Bones
+// are mirrored with `bone_mirror` and each contact state with the 
+// state of the mirror of its bone in `contact_bones`. Must be done 
+// before building or loading the matching features, which are then
+// normalized symmetrically so that mirroring them is just a fixed 
+// permutation and sign flip. Channels of mirrored bones should be 
+// given the same weight.
+void database_mirror(database& db, const slice1d<int> contact_bones);
+
+
+// Copy the normalized features or the contact states of a frame,
+// mirroring them for the mirrored frames
+void database_features(slice1d<float> features, const database& db, const int frame);
+void database_contacts(slice1d<bool> contacts, const database& db, const int frame);
+
+
+// Contact states of a frame as a mask with bit i set if contact i 
+// is, mirroring them for the mirrored frames
+uint32_t database_contact_mask(const database& db, const int frame);
+
+
+// Start reading in the pose data of the range containing a frame,
+// such as a transition target, if the database is paged
+void database_prefetch(const database& db, const int frame);
+
+
+// Get the pose of a frame, decoding it if the database is compressed,
+// deriving the velocities if they are not stored, reading it in if 
+// it is paged and mirroring it if it is a mirrored frame. Returns
+// false, leaving the outputs unchanged, if the pose of a paged 
+// database could not be read in.
+bool database_pose(
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const database& db,
+    const int frame);
+
+
+// Same but at a fractional time `alpha` between a frame and the 
+// next one of its range, lerping positions and velocities and 
+// nlerping rotations. Used to play back at any rate.
+bool database_pose_interpolated(
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const database& db,
+    const int frame,
+    const float alpha);
+
+
+// Compute the lower bound of the query distance for a block 
+// of BOUND_BLOCK_SIZE consecutive boxes starting at box index
+// `block * BOUND_BLOCK_SIZE`, and return a bitmask of the boxes 
+// in the block which have a lower bound less than `best_cost`.
+unsigned int motion_matching_bounds_block(
+    float* __restrict block_costs,
+    const slice2d<float> bound_min,
+    const slice2d<float> bound_max,
+    const slice1d<float> query_normalized,
+    const int block,
+    const float transition_cost,
+    const float best_cost);
 
 
 // Motion Matching search function essentially consists
 // of comparing every feature vector in the database, 
 // against the query feature vector, first checking the 
 // query distance to the axis aligned bounding boxes used 
-// for the acceleration structure.
-void motion_matching_search(
+// for the acceleration structure. The traversal starts from
+// the given range and slot and stops once `work` reaches 
+// `work_budget`, storing where it got to so that it can be 
+// continued later. Returns true once the whole database has
+// been visited. If `contact_filter` is not zero only frames
+// with one of its contacts in `contact_bits` are considered.
+bool motion_matching_search(
     int& __restrict best_index,
     float& __restrict best_cost,
+    int& __restrict range_cursor,
+    int& __restrict slot_cursor,
+    int& __restrict work,
+    const int curr_index,
     const slice1d<int> range_starts,
     const slice1d<int> range_stops,
+    const slice1d<int> search_order,
+    const slice1d<bool> searchable,
+    const slice1d<uint64_t> contact_bits,
+    const int ncontacts,
+    const uint32_t contact_filter,
     const slice2d<float> features,
     const slice1d<float> features_offset,
     const slice1d<float> features_scale,
@@ -214,7 +578,73 @@ void motion_matching_search(
     const slice1d<float> query_normalized,
     const float transition_cost,
     const int ignore_range_end,
-    const int ignore_surrounding);
+    const int ignore_surrounding,
+    const int work_budget);
+
+
+//---------------------------------------------------------------
+
+enum
+{
+    SEARCH_TIME_CHECK_WORK = 1024,
+};
+
+// State of a search which can be spread over several 
+// calls, for example across multiple ticks when we would 
+// rather take a slightly worse match than miss the frame 
+// budget. `best_index` and `best_cost` always hold the best
+// result found so far.
+struct database_search_cursor
+{
+    array1d<float> query_normalized;
+    int range = 0;
+    int slot = 0;
+    int curr_index = -1;
+    int best_index = -1;
+    float best_cost = FLT_MAX;
+    float transition_cost = 0.0f;
+    int ignore_range_end = 0;
+    int ignore_surrounding = 0;
+    uint32_t contact_filter = 0;
+    bool done = true;
+
+    // Mirrored databases are searched a second time with the query
+    // mirrored, which is the same as searching the mirrored frames
+    array1d<float> query_mirrored;
+    bool mirrored = false;
+};
+
+
+// Start a search of the database. The current frame 
+// `curr_index` (or -1) is evaluated straight away and 
+// `best_cost` acts as an initial upper bound: if no frame 
+// is found with a lower cost the best index stays -1. In 
+// mirrored databases the frames found can be mirrored ones.
+// When `contact_filter` is not zero, only frames where one of
+// the contacts in this mask is active are transitioned to, such 
+// as requiring a foot plant with the mask of both feet. The 
+// current frame is always kept as a candidate.
+void database_search_begin(
+    database_search_cursor& cursor,
+    const database& db,
+    const slice1d<float> query,
+    const int curr_index,
+    const float best_cost,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    const uint32_t contact_filter);
+
+
+// Continue a search for at most `work_budget` units of work 
+// (roughly one per feature vector or box compared) or 
+// `time_budget` seconds if positive. Returns true once the 
+// search is complete.
+bool database_search_continue(
+    database_search_cursor& cursor,
+    const database& db,
+    const int work_budget,
+    const double time_budget);
 
 
 // Search database
@@ -225,5 +655,46 @@ void database_search(
     const slice1d<float> query,
     const float transition_cost,
     const int ignore_range_end,
+    const int ignore_surrounding,
+    const uint32_t contact_filter);
+
+
+//---------------------------------------------------------------
+
+// Result of pruning a database. Costs are those of the best match
+// found for each replayed query, compared before and after.
+struct database_prune_report
+{
+    int nframes_searchable = 0;
+    int nframes_pruned = 0;
+
+    // Ranges left without any searchable frame
+    int nranges_pruned = 0;
+
+    int nqueries = 0;
+    float mean_cost_increase = 0.0f;
+    float max_cost_increase = 0.0f;
+};
+
+// Exclude from the search the frames which have a near duplicate 
+// elsewhere in the database: another searchable frame whose 
+// normalized features are within `feature_tolerance` and whose 
+// local pose is within `position_tolerance` meters and 
+// `rotation_tolerance` radians for every bone but the root. Frames
+// kept in place of others are never pruned themselves so every 
+// pruned frame is within tolerance of a searchable one. Frames 
+// less than `ignore_surrounding` apart are not duplicates, so 
+// only repeats of the same motion are pruned rather than each 
+// frame's neighbours. The bounds are rebuilt afterwards, and the 
+// recorded `queries` are searched before and after to measure how
+// much worse the best matches become.
+void database_prune(
+    database& db,
+    database_prune_report& report,
+    const slice2d<float> queries,
+    const float feature_tolerance,
+    const float position_tolerance,
+    const float rotation_tolerance,
+    const int ignore_range_end,
     const int ignore_surrounding);
 
@@ -0,0 +1,401 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "MMformat.h"
+
+#include "MMcharacter.h"
+#include "MMdatabase.h"
+#include "MMnnet.h"
+
+#include <limits.h>
+#include <string.h>
+
+MMformat::MMformat()
+{
+}
+
+MMformat::~MMformat()
+{
+}
+
+
+//---------------------------------------------------------------
+// FNV-1a but taking eight bytes at a time so that checking large
+// sections stays cheap compared to reading them
+uint64_t format_checksum(const void* data, const size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+
+    for (; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static uint64_t format_align(const uint64_t offset)
+{
+    return (offset + FORMAT_ALIGNMENT - 1) & ~(uint64_t)(FORMAT_ALIGNMENT - 1);
+}
+
+// `fseek` and `ftell` take a long which is only 32 bits on Windows
+static void format_seek(FILE* f, const uint64_t offset, const int origin)
+{
+#if defined(_MSC_VER)
+    _fseeki64(f, (__int64)offset, origin);
+#else
+    fseeko(f, (off_t)offset, origin);
+#endif
+}
+
+static uint64_t format_tell(FILE* f)
+{
+#if defined(_MSC_VER)
+    return (uint64_t)_ftelli64(f);
+#else
+    return (uint64_t)ftello(f);
+#endif
+}
+
+// Pad the file with zeros up to the next aligned offset
+static void format_write_padding(FILE* f)
+{
+    static const char zeros[FORMAT_ALIGNMENT] = { 0 };
+
+    uint64_t offset = format_tell(f);
+    fwrite(zeros, 1, (size_t)(format_align(offset) - offset), f);
+}
+
+static bool format_extents64(const format_header& header)
+{
+    return (header.flags & FORMAT_FLAG_EXTENTS64) != 0;
+}
+
+static size_t format_section_size(const format_header& header)
+{
+    return format_extents64(header) ? sizeof(format_section) : sizeof(format_section32);
+}
+
+// Read the section table in whichever way it is stored
+static void format_unpack_sections(slice1d<format_section> sections, const format_header& header, const char* table)
+{
+    if (format_extents64(header))
+    {
+        memcpy(sections.data, table, sections.size * sizeof(format_section));
+        return;
+    }
+
+    for (int i = 0; i < sections.size; i++)
+    {
+        format_section32 packed;
+        memcpy(&packed, table + i * sizeof(format_section32), sizeof(format_section32));
+
+        format_section& s = sections(i);
+        s.type = packed.type;
+        s.reserved = packed.reserved;
+        s.rows = packed.rows;
+        s.cols = packed.cols;
+        s.offset = packed.offset;
+        s.bytes = packed.bytes;
+        s.checksum = packed.checksum;
+    }
+}
+
+//---------------------------------------------------------------
+bool format_write_begin(format_writer& w, const char* filename, const int kind, const int nsections)
+{
+    w.file = fopen(filename, "wb");
+    if (w.file == NULL)
+    {
+        return false;
+    }
+
+    w.kind = kind;
+    w.sections.resize(nsections);
+    w.sections.zero();
+    w.nwritten = 0;
+
+    // Leave space for the header and table which are only known at the
+    // end, in case the table needs 64 bit extents
+    format_header header;
+    memset(&header, 0, sizeof(format_header));
+    fwrite(&header, sizeof(format_header), 1, w.file);
+    fwrite(w.sections.data, sizeof(format_section), w.sections.size, w.file);
+    format_write_padding(w.file);
+
+    return true;
+}
+
+void format_write_section(format_writer& w, const int type, const int64_t rows, const int64_t cols, const void* data, const size_t bytes)
+{
+    assert(w.file != NULL && w.nwritten < w.sections.size);
+
+    format_section& s = w.sections(w.nwritten);
+    s.type = type;
+    s.rows = rows;
+    s.cols = cols;
+    s.offset = format_tell(w.file);
+    s.bytes = bytes;
+    s.checksum = format_checksum(data, bytes);
+
+    assert(s.offset % FORMAT_ALIGNMENT == 0);
+
+    size_t num = fwrite(data, 1, bytes, w.file);
+    assert(num == bytes);
+    format_write_padding(w.file);
+
+    w.nwritten++;
+}
+
+void format_write_end(format_writer& w)
+{
+    assert(w.file != NULL && w.nwritten == w.sections.size);
+
+    format_header header;
+    memset(&header, 0, sizeof(format_header));
+    header.magic = FORMAT_MAGIC;
+    header.version = FORMAT_VERSION;
+    header.kind = w.kind;
+    header.nsections = (uint32_t)w.sections.size;
+    header.table_offset = sizeof(format_header);
+
+    for (int i = 0; i < w.sections.size; i++)
+    {
+        if (w.sections(i).rows > INT_MAX || w.sections(i).cols > INT_MAX)
+        {
+            header.version = FORMAT_VERSION_EXTENTS64;
+            header.flags |= FORMAT_FLAG_EXTENTS64;
+        }
+    }
+
+    format_seek(w.file, 0, SEEK_SET);
+    fwrite(&header, sizeof(format_header), 1, w.file);
+
+    if (format_extents64(header))
+    {
+        fwrite(w.sections.data, sizeof(format_section), w.sections.size, w.file);
+    }
+    else
+    {
+        for (int i = 0; i < w.sections.size; i++)
+        {
+            const format_section& s = w.sections(i);
+
+            format_section32 packed;
+            packed.type = s.type;
+            packed.rows = (int32_t)s.rows;
+            packed.cols = (int32_t)s.cols;
+            packed.reserved = 0;
+            packed.offset = s.offset;
+            packed.bytes = s.bytes;
+            packed.checksum = s.checksum;
+            fwrite(&packed, sizeof(format_section32), 1, w.file);
+        }
+    }
+
+    fclose(w.file);
+    w.file = NULL;
+}
+
+//---------------------------------------------------------------
+// Check the kind and version in a header, and that its table of
+// sections lies within the file
+static bool format_validate_header(const format_header& header, const uint64_t size, const int kind)
+{
+    const uint32_t version = format_extents64(header) ? FORMAT_VERSION_EXTENTS64 : FORMAT_VERSION;
+
+    if (header.version != version || header.kind != (uint32_t)kind)
+    {
+        UE_LOG(LogTemp, Error, TEXT("File is of kind %u version %u where kind %d version %u was expected"),
+            header.kind, header.version, kind, version);
+        return false;
+    }
+
+    return 
+        header.table_offset <= size &&
+        (uint64_t)header.nsections * format_section_size(header) <= size - header.table_offset;
+}
+
+// Check that every section lies within the file
+static bool format_validate_sections(const format_reader& r, const uint64_t size)
+{
+    for (int i = 0; i < r.nsections(); i++)
+    {
+        const format_section& s = r.sections(i);
+
+        if (s.offset % FORMAT_ALIGNMENT != 0 || s.offset > size || s.bytes > size - s.offset || s.rows < 0 || s.cols < -1)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool format_open(format_reader& r, const char* filename, const int kind)
+{
+    r.invalid = false;
+    r.file = fopen(filename, "rb");
+    if (r.file == NULL)
+    {
+        return false;
+    }
+
+    if (fread(&r.header, sizeof(format_header), 1, r.file) != 1 || r.header.magic != FORMAT_MAGIC)
+    {
+        format_close(r);
+        return false;
+    }
+
+    r.invalid = true;
+
+    format_seek(r.file, 0, SEEK_END);
+    uint64_t size = format_tell(r.file);
+
+    // The table size comes from the file so is checked before allocating it
+    if (!format_validate_header(r.header, size, kind))
+    {
+        format_close(r);
+        return false;
+    }
+
+    array1d<char> table(r.header.nsections * format_section_size(r.header));
+    format_seek(r.file, r.header.table_offset, SEEK_SET);
+
+    if (fread(table.data, 1, table.size, r.file) != (size_t)table.size)
+    {
+        format_close(r);
+        return false;
+    }
+
+    r.sections.resize(r.header.nsections);
+    format_unpack_sections(r.sections, r.header, table.data);
+
+    if (!format_validate_sections(r, size))
+    {
+        format_close(r);
+        return false;
+    }
+
+    r.invalid = false;
+
+    return true;
+}
+
+bool format_open_memory(format_reader& r, const char* data, const size_t size, const int kind)
+{
+    r.invalid = false;
+
+    if (size < sizeof(format_header))
+    {
+        return false;
+    }
+
+    memcpy(&r.header, data, sizeof(format_header));
+
+    if (r.header.magic != FORMAT_MAGIC)
+    {
+        return false;
+    }
+
+    r.invalid = true;
+
+    if (!format_validate_header(r.header, size, kind))
+    {
+        return false;
+    }
+
+    r.sections.resize(r.header.nsections);
+    format_unpack_sections(r.sections, r.header, data + r.header.table_offset);
+
+    if (!format_validate_sections(r, size))
+    {
+        r.sections.resize(0);
+        return false;
+    }
+
+    r.invalid = false;
+
+    r.data = data;
+    r.size = size;
+
+    return true;
+}
+
+void format_close(format_reader& r)
+{
+    if (r.file != NULL)
+    {
+        fclose(r.file);
+    }
+
+    r.file = NULL;
+    r.data = NULL;
+    r.size = 0;
+    r.sections.resize(0);
+}
+
+bool format_read_section(format_reader& r, const int section, const int type, const int64_t rows, const int64_t cols, void* data, const size_t bytes)
+{
+    if (section >= r.nsections())
+    {
+        return false;
+    }
+
+    const format_section& s = r.sections(section);
+
+    if ((int)s.type != type || s.rows != rows || s.cols != cols || s.bytes != bytes)
+    {
+        return false;
+    }
+
+    if (r.file != NULL)
+    {
+        format_seek(r.file, s.offset, SEEK_SET);
+        if (fread(data, 1, bytes, r.file) != bytes)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        memcpy(data, r.data + s.offset, bytes);
+    }
+
+    return format_checksum(data, bytes) == s.checksum;
+}
+
+//---------------------------------------------------------------
+void format_convert(const char* src_filename, const char* dst_filename, const int kind)
+{
+    // The loaders still read the original format so converting
+    // is just loading and saving again
+    if (kind == FORMAT_CHARACTER)
+    {
+        character c;
+        character_load(c, src_filename);
+        character_save(c, dst_filename);
+    }
+    else if (kind == FORMAT_DATABASE)
+    {
+        database db;
+        database_load(db, src_filename);
+        database_save(db, dst_filename);
+    }
+    else if (kind == FORMAT_NNET)
+    {
+        nnet nn;
+        nnet_load(nn, src_filename);
+        nnet_save(nn, dst_filename);
+    }
+}
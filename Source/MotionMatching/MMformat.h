@@ -0,0 +1,235 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+
+#include "MMvec.h"
+#include "MMquat.h"
+#include "MMarray.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+
+
+#include "CoreMinimal.h"
+
+/**
+ * 
+ */
+class MOTIONMATCHING_API MMformat
+{
+public:
+	MMformat();
+	~MMformat();
+};
+
+
+//---------------------------------------------------------------
+
+// Version 2 of the character, database and network files. Rather
+// than a bare sequence of arrays these start with a header and a
+// table giving the offset, element type, shape and checksum of
+// every section, so any section can be read (or viewed in memory)
+// without parsing those before it. Payloads are aligned to
+// FORMAT_ALIGNMENT bytes so they can be used in place for SIMD.
+//
+// Files with a section of more than INT_MAX rows or columns are
+// written as version 3 with FORMAT_FLAG_EXTENTS64 set, in which
+// case the table holds 64 bit extents. Others are still version 2
+// so that they can be read by older builds.
+enum
+{
+    FORMAT_MAGIC = 0x3246464d, // "MFF2"
+    FORMAT_VERSION = 2,
+    FORMAT_VERSION_EXTENTS64 = 3,
+    FORMAT_ALIGNMENT = 64,
+};
+
+enum format_flags
+{
+    FORMAT_FLAG_EXTENTS64 = 1 << 0,
+};
+
+enum format_kind
+{
+    FORMAT_CHARACTER = 1,
+    FORMAT_DATABASE = 2,
+    FORMAT_NNET = 3,
+};
+
+enum format_type
+{
+    FORMAT_TYPE_BOOL = 1,
+    FORMAT_TYPE_UINT16 = 2,
+    FORMAT_TYPE_INT32 = 3,
+    FORMAT_TYPE_FLOAT = 4,
+    FORMAT_TYPE_VEC2 = 5,
+    FORMAT_TYPE_VEC3 = 6,
+    FORMAT_TYPE_QUAT = 7,
+};
+
+static inline int format_type_of(const bool*) { return FORMAT_TYPE_BOOL; }
+static inline int format_type_of(const unsigned short*) { return FORMAT_TYPE_UINT16; }
+static inline int format_type_of(const int*) { return FORMAT_TYPE_INT32; }
+static inline int format_type_of(const float*) { return FORMAT_TYPE_FLOAT; }
+static inline int format_type_of(const vec2*) { return FORMAT_TYPE_VEC2; }
+static inline int format_type_of(const vec3*) { return FORMAT_TYPE_VEC3; }
+static inline int format_type_of(const quat*) { return FORMAT_TYPE_QUAT; }
+
+struct format_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    uint32_t nsections;
+    uint64_t table_offset;
+    uint32_t flags;
+    uint8_t reserved[36];
+};
+
+// One dimensional sections have `cols` set to -1. This is also how
+// the table is stored when FORMAT_FLAG_EXTENTS64 is set.
+struct format_section
+{
+    uint32_t type;
+    uint32_t reserved;
+    int64_t rows;
+    int64_t cols;
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t checksum;
+};
+
+// How the table is stored otherwise
+struct format_section32
+{
+    uint32_t type;
+    int32_t rows;
+    int32_t cols;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(format_header) == FORMAT_ALIGNMENT, "Header must keep the table aligned");
+static_assert(sizeof(format_section) == 48, "Section table entries must be packed");
+static_assert(sizeof(format_section32) == 40, "Section table entries must be packed");
+
+// Checksum of a section payload
+uint64_t format_checksum(const void* data, const size_t size);
+
+//---------------------------------------------------------------
+
+// Writes sections one after the other, filling in the header and
+// section table once all of them have been written
+struct format_writer
+{
+    FILE* file = NULL;
+    uint32_t kind = 0;
+    array1d<format_section> sections;
+    int nwritten = 0;
+};
+
+// Start writing a file with the given number of sections
+bool format_write_begin(format_writer& w, const char* filename, const int kind, const int nsections);
+
+// Write the payload of the next section
+void format_write_section(format_writer& w, const int type, const int64_t rows, const int64_t cols, const void* data, const size_t bytes);
+
+// Write the header and section table and close the file
+void format_write_end(format_writer& w);
+
+template<typename T>
+void format_write_array1d(format_writer& w, const array1d<T>& arr)
+{
+    format_write_section(w, format_type_of(arr.data), arr.size, -1, arr.data, (size_t)arr.size * sizeof(T));
+}
+
+template<typename T>
+void format_write_array2d(format_writer& w, const array2d<T>& arr)
+{
+    format_write_section(w, format_type_of(arr.data), arr.rows, arr.cols, arr.data, (size_t)arr.rows * arr.cols * sizeof(T));
+}
+
+//---------------------------------------------------------------
+
+// Reads sections either from a file or from a buffer already in
+// memory, such as a memory mapped file
+struct format_reader
+{
+    FILE* file = NULL;
+    const char* data = NULL;
+    size_t size = 0;
+    format_header header;
+    array1d<format_section> sections;
+
+    // Set when opening fails on a file which is in this format, but of 
+    // another kind or version or damaged. It must then not be read as
+    // the original format either.
+    bool invalid = false;
+
+    int nsections() const { return (int)sections.size; }
+};
+
+// Open a file, returning false if it is not in this format (in which
+// case it can be read as the original format). A file of another
+// kind or version is an error: it is logged, false is returned and
+// `invalid` is set.
+bool format_open(format_reader& r, const char* filename, const int kind);
+
+// Same for a buffer in memory, which must outlive the reader
+bool format_open_memory(format_reader& r, const char* data, const size_t size, const int kind);
+
+void format_close(format_reader& r);
+
+// Copy the payload of a section after checking its type, shape and
+// checksum. Returns false if any of these don't match.
+bool format_read_section(format_reader& r, const int section, const int type, const int64_t rows, const int64_t cols, void* data, const size_t bytes);
+
+template<typename T>
+bool format_read_array1d(format_reader& r, const int section, array1d<T>& arr)
+{
+    if (section >= r.nsections() || r.sections(section).cols != -1) { return false; }
+    arr.resize(r.sections(section).rows);
+    return format_read_section(r, section, format_type_of(arr.data), arr.size, -1, arr.data, (size_t)arr.size * sizeof(T));
+}
+
+template<typename T>
+bool format_read_array2d(format_reader& r, const int section, array2d<T>& arr)
+{
+    if (section >= r.nsections() || r.sections(section).cols == -1) { return false; }
+    arr.resize(r.sections(section).rows, r.sections(section).cols);
+    return format_read_section(r, section, format_type_of(arr.data), arr.rows, arr.cols, arr.data, (size_t)arr.rows * arr.cols * sizeof(T));
+}
+
+// View the payload of a section of a reader opened on memory without
+// copying it. Checksums are not verified so that pages of a memory
+// mapped file are only touched once they are used.
+template<typename T>
+bool format_view_array1d(const format_reader& r, const int section, array1d<T>& arr)
+{
+    if (r.data == NULL || section >= r.nsections()) { return false; }
+    const format_section& s = r.sections(section);
+    if (s.type != format_type_of(arr.data) || s.cols != -1 || s.bytes != (uint64_t)s.rows * sizeof(T)) { return false; }
+    array1d_view(arr, s.rows, (T*)(r.data + s.offset));
+    return true;
+}
+
+template<typename T>
+bool format_view_array2d(const format_reader& r, const int section, array2d<T>& arr)
+{
+    if (r.data == NULL || section >= r.nsections()) { return false; }
+    const format_section& s = r.sections(section);
+    if (s.type != format_type_of(arr.data) || s.cols == -1 || s.bytes != (uint64_t)s.rows * s.cols * sizeof(T)) { return false; }
+    array2d_view(arr, s.rows, s.cols, (T*)(r.data + s.offset));
+    return true;
+}
+
+//---------------------------------------------------------------
+
+// Convert a character, database or network file from the original
+// format to this one. The source and destination can be the same 
+// file. Used by the MotionMatchingInspect commandlet.
+void format_convert(const char* src_filename, const char* dst_filename, const int kind);
@@ -0,0 +1,375 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "MMinspect.h"
+
+#include <float.h>
+#include <math.h>
+
+MMinspect::MMinspect()
+{
+}
+
+MMinspect::~MMinspect()
+{
+}
+
+
+//---------------------------------------------------------------
+static int inspect_count_nonfinite(const float* data, const int64_t size)
+{
+    int count = 0;
+    for (int64_t i = 0; i < size; i++)
+    {
+        count += isfinite(data[i]) ? 0 : 1;
+    }
+
+    return count;
+}
+
+template<typename T>
+static int inspect_count_nonfinite(const array1d<T>& arr)
+{
+    return inspect_count_nonfinite((const float*)arr.data, arr.size * (int64_t)(sizeof(T) / sizeof(float)));
+}
+
+template<typename T>
+static int inspect_count_nonfinite(const array2d<T>& arr)
+{
+    return inspect_count_nonfinite((const float*)arr.data, arr.rows * arr.cols * (int64_t)(sizeof(T) / sizeof(float)));
+}
+
+// One line of the memory table, adding the bytes to the total
+template<typename T>
+static void inspect_memory(FILE* out, int64_t& total, const char* name, const array1d<T>& arr)
+{
+    int64_t bytes = arr.size * (int64_t)sizeof(T);
+    fprintf(out, "    %-32s %10lld        %12.3f KB%s\n", name, (long long)arr.size, bytes / 1024.0, arr.view ? " (viewed)" : "");
+    total += arr.view ? 0 : bytes;
+}
+
+template<typename T>
+static void inspect_memory(FILE* out, int64_t& total, const char* name, const array2d<T>& arr)
+{
+    int64_t bytes = arr.rows * arr.cols * (int64_t)sizeof(T);
+    fprintf(out, "    %-32s %10lld x %-5lld %12.3f KB%s\n", name, (long long)arr.rows, (long long)arr.cols, bytes / 1024.0, arr.view ? " (viewed)" : "");
+    total += arr.view ? 0 : bytes;
+}
+
+// Report the number of non finite values in an array if any,
+// returning it as the number of problems
+template<typename A>
+static int inspect_nonfinite(FILE* out, const char* name, const A& arr)
+{
+    int count = inspect_count_nonfinite(arr);
+    if (count > 0)
+    {
+        fprintf(out, "    ERROR: %d non finite values in %s\n", count, name);
+    }
+
+    return count > 0 ? 1 : 0;
+}
+
+//---------------------------------------------------------------
+static void database_inspect_memory(FILE* out, const database& db)
+{
+    int64_t total = 0;
+
+    fprintf(out, "Memory (viewed arrays are mapped from the file and not counted)\n");
+    inspect_memory(out, total, "bone_positions", db.bone_positions);
+    inspect_memory(out, total, "bone_velocities", db.bone_velocities);
+    inspect_memory(out, total, "bone_rotations", db.bone_rotations);
+    inspect_memory(out, total, "bone_angular_velocities", db.bone_angular_velocities);
+    inspect_memory(out, total, "bone_parents", db.bone_parents);
+    inspect_memory(out, total, "bone_rotations_compressed", db.bone_rotations_compressed);
+    inspect_memory(out, total, "bone_root_positions_compressed", db.bone_root_positions_compressed);
+    inspect_memory(out, total, "bone_positions_compressed", db.bone_positions_compressed);
+    inspect_memory(out, total, "range_starts", db.range_starts);
+    inspect_memory(out, total, "range_stops", db.range_stops);
+    inspect_memory(out, total, "frame_ranges", db.frame_ranges);
+    inspect_memory(out, total, "contact_bits", db.contact_bits);
+    inspect_memory(out, total, "features", db.features);
+    inspect_memory(out, total, "features_offset", db.features_offset);
+    inspect_memory(out, total, "features_scale", db.features_scale);
+    inspect_memory(out, total, "search_order", db.search_order);
+    inspect_memory(out, total, "searchable", db.searchable);
+    inspect_memory(out, total, "bound_sm_min", db.bound_sm_min);
+    inspect_memory(out, total, "bound_sm_max", db.bound_sm_max);
+    inspect_memory(out, total, "bound_lr_min", db.bound_lr_min);
+    inspect_memory(out, total, "bound_lr_max", db.bound_lr_max);
+    fprintf(out, "    %-32s %38.3f MB\n", "total", total / (1024.0 * 1024.0));
+}
+
+// Ranges are bucketed by powers of two of their length in frames
+static int database_inspect_ranges(FILE* out, const database& db, const int ignore_range_end)
+{
+    enum { NBUCKETS = 16 };
+
+    int problems = 0;
+    int buckets[NBUCKETS] = { 0 };
+    int nshort = 0;
+    int min_length = INT_MAX, max_length = 0;
+    int64_t total = 0;
+
+    for (int r = 0; r < db.nranges(); r++)
+    {
+        int length = db.range_stops(r) - db.range_starts(r);
+
+        if (length <= 0 || db.range_starts(r) < 0 || db.range_stops(r) > db.nframes())
+        {
+            fprintf(out, "    ERROR: range %d spans frames %d to %d of %d\n", r, db.range_starts(r), db.range_stops(r), db.nframes());
+            problems++;
+            continue;
+        }
+
+        int bucket = 0;
+        while (bucket < NBUCKETS - 1 && (1 << (bucket + 1)) <= length)
+        {
+            bucket++;
+        }
+
+        buckets[bucket]++;
+        nshort += length <= ignore_range_end + INSPECT_SHORT_RANGE_FRAMES ? 1 : 0;
+        min_length = length < min_length ? length : min_length;
+        max_length = length > max_length ? length : max_length;
+        total += length;
+    }
+
+    fprintf(out, "Ranges: %d, length min %d, max %d, mean %.1f frames\n",
+        db.nranges(), db.nranges() > 0 ? min_length : 0, max_length, db.nranges() > 0 ? (double)total / db.nranges() : 0.0);
+
+    int largest = 1;
+    for (int b = 0; b < NBUCKETS; b++)
+    {
+        largest = buckets[b] > largest ? buckets[b] : largest;
+    }
+
+    for (int b = 0; b < NBUCKETS; b++)
+    {
+        if (buckets[b] == 0) { continue; }
+
+        char bar[41];
+        int width = (buckets[b] * 40 + largest - 1) / largest;
+        memset(bar, '#', width);
+        bar[width] = '\0';
+
+        fprintf(out, "    %6d - %-6d %6d %s\n", 1 << b, (1 << (b + 1)) - 1, buckets[b], bar);
+    }
+
+    if (nshort > 0)
+    {
+        fprintf(out, "    WARNING: %d ranges are at most %d frames longer than the %d ignored at their end\n",
+            nshort, INSPECT_SHORT_RANGE_FRAMES, ignore_range_end);
+    }
+
+    return problems;
+}
+
+static int database_inspect_bone_parents(FILE* out, const database& db)
+{
+    int problems = 0;
+
+    // Forward kinematics over all bones in order relies on each
+    // parent coming before its children
+    for (int b = 0; b < db.nbones(); b++)
+    {
+        int parent = db.bone_parents(b);
+        bool valid = b == 0 ? parent == -1 : parent >= 0 && parent < b;
+
+        if (!valid)
+        {
+            fprintf(out, "    ERROR: bone %d has parent %d\n", b, parent);
+            problems++;
+        }
+    }
+
+    return problems;
+}
+
+// Statistics of the normalized features, along with the offset
+// and scale they are normalized with
+static int database_inspect_features(FILE* out, const database& db)
+{
+    int problems = 0;
+
+    fprintf(out, "Features: %d dimensions in %d channels\n", db.nfeatures(), db.schema.nchannels());
+    fprintf(out, "    %4s %7s %4s %4s %10s %10s %10s %10s %10s %10s\n",
+        "dim", "channel", "type", "bone", "offset", "scale", "mean", "std", "min", "max");
+
+    int channel = 0;
+    int channel_end = db.schema.nchannels() > 0 ? db.schema.channels(0).size() : db.nfeatures();
+
+    for (int j = 0; j < db.nfeatures(); j++)
+    {
+        while (channel < db.schema.nchannels() - 1 && j >= channel_end)
+        {
+            channel++;
+            channel_end += db.schema.channels(channel).size();
+        }
+
+        double sum = 0.0, sum_sq = 0.0;
+        float min = FLT_MAX, max = -FLT_MAX;
+        for (int i = 0; i < db.features.rows; i++)
+        {
+            float x = db.features(i, j);
+            sum += x;
+            sum_sq += (double)x * x;
+            min = x < min ? x : min;
+            max = x > max ? x : max;
+        }
+
+        double mean = db.features.rows > 0 ? sum / db.features.rows : 0.0;
+        double std = db.features.rows > 0 ? sqrt(fmax(sum_sq / db.features.rows - mean * mean, 0.0)) : 0.0;
+
+        bool has_channel = channel < db.schema.nchannels();
+        fprintf(out, "    %4d %7d %4d %4d %10.4f %10.4f %10.4f %10.4f %10.4f %10.4f%s\n",
+            j, channel,
+            has_channel ? db.schema.channels(channel).type : -1,
+            has_channel ? db.schema.channels(channel).bone : -1,
+            db.features_offset(j), db.features_scale(j),
+            mean, std, min, max,
+            max - min <= 0.0f ? " constant" : "");
+
+        if (!(db.features_scale(j) > 0.0f))
+        {
+            fprintf(out, "    ERROR: feature %d has scale %f\n", j, db.features_scale(j));
+            problems++;
+        }
+    }
+
+    return problems;
+}
+
+// Average volume and extent of the non empty boxes of one level
+static void database_inspect_bound_level(
+    FILE* out,
+    const char* name,
+    const slice2d<float> bound_min,
+    const slice2d<float> bound_max,
+    const int nboxes)
+{
+    double volume = 0.0, extent = 0.0;
+    int nfilled = 0;
+
+    for (int i = 0; i < nboxes; i++)
+    {
+        if (bound_min.rows == 0 || bound_min(0, i) > bound_max(0, i))
+        {
+            continue;
+        }
+
+        double box_volume = 1.0;
+        for (int j = 0; j < bound_min.rows; j++)
+        {
+            double box_extent = bound_max(j, i) - bound_min(j, i);
+            box_volume *= box_extent;
+            extent += box_extent;
+        }
+
+        volume += box_volume;
+        nfilled++;
+    }
+
+    fprintf(out, "    %-6s %8d boxes, %8d empty, mean volume %12.6g, mean extent %8.4f\n",
+        name, nboxes, nboxes - nfilled,
+        nfilled > 0 ? volume / nfilled : 0.0,
+        nfilled > 0 ? extent / ((double)nfilled * bound_min.rows) : 0.0);
+}
+
+static void database_inspect_bounds(FILE* out, const database& db)
+{
+    fprintf(out, "Bounds (in normalized feature units, smaller prune more)\n");
+    database_inspect_bound_level(out, "small", db.bound_sm_min, db.bound_sm_max, db.nbound_sm());
+    database_inspect_bound_level(out, "large", db.bound_lr_min, db.bound_lr_max, db.nbound_lr());
+}
+
+//---------------------------------------------------------------
+int database_inspect(
+    FILE* out,
+    const database& db,
+    const int ignore_range_end)
+{
+    int problems = 0;
+
+    fprintf(out, "Database: %d frames, %d bones, %d contacts, %.1f Hz%s%s\n",
+        db.nframes(), db.nbones(), db.ncontacts(), db.frame_rate,
+        db.compressed() ? ", compressed" : "",
+        db.velocities_derived() ? ", velocities derived" : "");
+
+    database_inspect_memory(out, db);
+    problems += database_inspect_ranges(out, db, ignore_range_end);
+
+    fprintf(out, "Checks\n");
+    problems += database_inspect_bone_parents(out, db);
+    problems += inspect_nonfinite(out, "bone_positions", db.bone_positions);
+    problems += inspect_nonfinite(out, "bone_velocities", db.bone_velocities);
+    problems += inspect_nonfinite(out, "bone_rotations", db.bone_rotations);
+    problems += inspect_nonfinite(out, "bone_angular_velocities", db.bone_angular_velocities);
+    problems += inspect_nonfinite(out, "bone_root_positions_compressed", db.bone_root_positions_compressed);
+    problems += inspect_nonfinite(out, "features", db.features);
+    problems += inspect_nonfinite(out, "features_offset", db.features_offset);
+    problems += inspect_nonfinite(out, "features_scale", db.features_scale);
+
+    if (db.features.rows > 0 && db.features.rows != db.nframes())
+    {
+        fprintf(out, "    ERROR: %d feature rows for %d frames\n", (int)db.features.rows, db.nframes());
+        problems++;
+    }
+
+    if (db.nfeatures() > 0)
+    {
+        problems += database_inspect_features(out, db);
+        database_inspect_bounds(out, db);
+    }
+
+    fprintf(out, "%d problems found in the database\n", problems);
+
+    return problems;
+}
+
+int nnet_inspect(
+    FILE* out,
+    const nnet& nn,
+    const char* name)
+{
+    int problems = 0;
+    int64_t nparams = 0;
+
+    fprintf(out, "Network %s: %d inputs, %d outputs, %d layers\n",
+        name, (int)nn.input_mean.size, (int)nn.output_mean.size, (int)nn.weights.size());
+
+    for (int l = 0; l < (int)nn.weights.size(); l++)
+    {
+        int64_t layer_params = nn.weights[l].rows * nn.weights[l].cols + nn.biases[l].size;
+        fprintf(out, "    layer %d %6lld x %-6lld %12.3f KB\n", l,
+            (long long)nn.weights[l].rows, (long long)nn.weights[l].cols, layer_params * sizeof(float) / 1024.0);
+        nparams += layer_params;
+
+        char layer_name[64];
+        snprintf(layer_name, sizeof(layer_name), "weights of layer %d", l);
+        problems += inspect_nonfinite(out, layer_name, nn.weights[l]);
+        snprintf(layer_name, sizeof(layer_name), "biases of layer %d", l);
+        problems += inspect_nonfinite(out, layer_name, nn.biases[l]);
+    }
+
+    fprintf(out, "    %lld parameters, %.3f MB\n", (long long)nparams, nparams * sizeof(float) / (1024.0 * 1024.0));
+
+    problems += inspect_nonfinite(out, "input_mean", nn.input_mean);
+    problems += inspect_nonfinite(out, "input_std", nn.input_std);
+    problems += inspect_nonfinite(out, "output_mean", nn.output_mean);
+    problems += inspect_nonfinite(out, "output_std", nn.output_std);
+
+    // Inputs are divided by their deviation
+    for (int i = 0; i < nn.input_std.size; i++)
+    {
+        if (nn.input_std(i) == 0.0f)
+        {
+            fprintf(out, "    ERROR: input %d has zero deviation\n", i);
+            problems++;
+        }
+    }
+
+    fprintf(out, "%d problems found in network %s\n", problems, name);
+
+    return problems;
+}
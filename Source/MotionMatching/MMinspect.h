@@ -0,0 +1,52 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+
+#include "MMarray.h"
+#include "MMdatabase.h"
+#include "MMnnet.h"
+
+#include <stdio.h>
+
+
+#include "CoreMinimal.h"
+
+/**
+ * 
+ */
+class MOTIONMATCHING_API MMinspect
+{
+public:
+	MMinspect();
+	~MMinspect();
+};
+
+
+//---------------------------------------------------------------
+
+// Ranges no longer than this many frames more than the ignored
+// end of each range are reported as too short to be searched much
+enum
+{
+    INSPECT_SHORT_RANGE_FRAMES = 10,
+};
+
+// Print a report on a loaded database to `out`: the memory taken
+// by each array, a histogram of range lengths, statistics of each
+// feature dimension, how tight the search bounds are, and checks
+// for non finite values and bones ordered before their parents.
+// The features and bounds are only reported if built or loaded.
+// Returns the number of problems found, which would break the
+// search or playback, as opposed to merely suspicious data.
+int database_inspect(
+    FILE* out,
+    const database& db,
+    const int ignore_range_end);
+
+// Same for a network: the shape and memory of each layer, and
+// non finite weights or zero deviations in the normalization
+int nnet_inspect(
+    FILE* out,
+    const nnet& nn,
+    const char* name);
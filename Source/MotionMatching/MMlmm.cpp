@@ -268,3 +268,101 @@ void projector_evaluate(
         best_cost = sqrtf(best_cost);
     }
 }
+
+
+
+// This function performs an exact database search but 
+// first uses the projector network to find an approximate
+// nearest feature vector, the distance to which is used as 
+// the initial bound for pruning the search.
+void projector_seeded_search(
+    int& best_index,
+    float& best_cost,
+    projector_search_stats& stats,
+    slice1d<float> proj_features,
+    nnet_evaluation& evaluation,
+    const database& db,
+    const slice1d<float> query,
+    const nnet& nn,
+    const float transition_cost = 0.0f,
+    const int ignore_range_end = 20,
+    const int ignore_surrounding = 20,
+    const float bound_scale = 1.5f,
+    const float sufficient_distance = 0.1f,
+    const uint32_t contact_filter = 0)
+{
+    slice1d<float> input_layer = evaluation.layers.front();
+    slice1d<float> output_layer = evaluation.layers.back();
+
+    // Copy normalized query features to input, keeping them aside
+    // as evaluating the network normalizes the input in place
+
+    array1d<float> query_normalized(query.size);
+    for (int i = 0; i < query.size; i++)
+    {
+        query_normalized(i) = (query(i) - db.features_offset(i)) / db.features_scale(i);
+        input_layer(i) = query_normalized(i);
+    }
+
+    // Evaluate network
+
+    nnet_evaluate(evaluation, nn);
+
+    // Compute the squared distance of the projection in the 
+    // same normalized space the database search uses
+
+    float proj_cost = 0.0f;
+    for (int i = 0; i < proj_features.size; i++)
+    {
+        proj_features(i) = output_layer(i);
+        proj_cost += squaref(query_normalized(i) - proj_features(i));
+    }
+
+    // Search with the projection as bound
+
+    int curr_index = best_index;
+
+    best_cost = bound_scale * proj_cost + transition_cost;
+
+    database_search(
+        best_index,
+        best_cost,
+        db,
+        query,
+        transition_cost,
+        ignore_range_end,
+        ignore_surrounding,
+        contact_filter);
+
+    stats.searches++;
+
+    // Nothing found inside the bound so do a full search
+
+    bool fallback = best_index == -1;
+
+    if (fallback)
+    {
+        best_index = curr_index;
+        best_cost = FLT_MAX;
+
+        database_search(
+            best_index,
+            best_cost,
+            db,
+            query,
+            transition_cost,
+            ignore_range_end,
+            ignore_surrounding,
+            contact_filter);
+
+        stats.fallbacks++;
+    }
+
+    // Check if the projection alone would have been as good. After a
+    // fallback the best match is outside the bound so never is.
+
+    if (!fallback && sqrtf(proj_cost) <= sqrtf(maxf(best_cost, 0.0f)) + sufficient_distance)
+    {
+        stats.projector_sufficient++;
+    }
+}
@@ -8,6 +8,7 @@
 #include "MMquat.h"
 #include "MMarray.h"
 #include "MMnnet.h"
+#include "MMdatabase.h"
 
 
 #include "CoreMinimal.h"
@@ -73,3 +74,41 @@ void projector_evaluate(
     const slice1d<float> curr_features,
     const nnet& nn,
     const float transition_cost);
+
+
+// Counters describing how the projector performed 
+// when used to seed exact database searches
+struct projector_search_stats
+{
+    int searches = 0;
+    int fallbacks = 0;
+    int projector_sufficient = 0;
+};
+
+
+// This function performs an exact database search but 
+// first uses the projector network to find an approximate
+// nearest feature vector. The distance to this projection 
+// (scaled by `bound_scale`) is used as the initial bound for 
+// pruning the search. If no frame is found within that bound 
+// the search is repeated without it, so results are always
+// exact. The projector is counted as sufficient when the 
+// distance to the projection is within `sufficient_distance`
+// of the distance to the exact best match, which can only
+// happen when the bounded search did not need to fall back.
+// `contact_filter` is passed on to `database_search`.
+void projector_seeded_search(
+    int& best_index,
+    float& best_cost,
+    projector_search_stats& stats,
+    slice1d<float> proj_features,
+    nnet_evaluation& evaluation,
+    const database& db,
+    const slice1d<float> query,
+    const nnet& nn,
+    const float transition_cost,
+    const int ignore_range_end,
+    const int ignore_surrounding,
+    const float bound_scale,
+    const float sufficient_distance,
+    const uint32_t contact_filter);
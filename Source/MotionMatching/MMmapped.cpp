@@ -0,0 +1,69 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "MMmapped.h"
+
+#include "HAL/PlatformFileManager.h"
+#include "Async/MappedFileHandle.h"
+
+#if PLATFORM_LINUX
+#include <sys/mman.h>
+#endif
+
+MMmapped::MMmapped()
+{
+}
+
+MMmapped::~MMmapped()
+{
+}
+
+
+//---------------------------------------------------------------
+mapped_file::~mapped_file()
+{
+    mapped_file_close(*this);
+}
+
+bool mapped_file_open(mapped_file& file, const char* filename, const bool huge_pages)
+{
+    mapped_file_close(file);
+
+    file.handle = FPlatformFileManager::Get().GetPlatformFile().OpenMapped(ANSI_TO_TCHAR(filename));
+    if (file.handle == NULL)
+    {
+        return false;
+    }
+
+    file.region = file.handle->MapRegion(0, file.handle->GetFileSize());
+    if (file.region == NULL)
+    {
+        mapped_file_close(file);
+        return false;
+    }
+
+    file.data = (const char*)file.region->GetMappedPtr();
+    file.size = file.region->GetMappedSize();
+
+#if PLATFORM_LINUX
+    // Transparent huge pages for file mappings depend on the kernel
+    // configuration so this is only a hint and failure is ignored
+    if (huge_pages)
+    {
+        madvise((void*)file.data, file.size, MADV_HUGEPAGE);
+    }
+#endif
+
+    return true;
+}
+
+void mapped_file_close(mapped_file& file)
+{
+    delete file.region;
+    delete file.handle;
+
+    file.region = NULL;
+    file.handle = NULL;
+    file.data = NULL;
+    file.size = 0;
+}
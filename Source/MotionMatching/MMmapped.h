@@ -0,0 +1,47 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+/**
+ * 
+ */
+class MOTIONMATCHING_API MMmapped
+{
+public:
+	MMmapped();
+	~MMmapped();
+};
+
+
+//---------------------------------------------------------------
+
+// A whole file mapped read-only into memory. Pages are only read
+// from disk when first accessed and, because the mapping is backed
+// by the page cache, every process mapping the same file shares a
+// single physical copy of it.
+struct mapped_file
+{
+    IMappedFileHandle* handle = NULL;
+    IMappedFileRegion* region = NULL;
+    const char* data = NULL;
+    int64 size = 0;
+
+    mapped_file() {}
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+};
+
+// Map a file into memory, optionally asking for it to be backed by
+// huge pages (only supported on Linux). Returns false on failure.
+bool mapped_file_open(mapped_file& file, const char* filename, const bool huge_pages);
+
+// Unmap the file. Any arrays viewing it must not be used afterwards.
+void mapped_file_close(mapped_file& file);
+
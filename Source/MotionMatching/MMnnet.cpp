@@ -2,6 +2,7 @@
 
 
 #include "MMnnet.h"
+#include "MMformat.h"
 
 MMnnet::MMnnet()
 {
@@ -16,8 +17,43 @@ MMnnet::~MMnnet()
 //--------------------------------------
 
 
+// In the versioned format the four normalization sections are 
+// followed by the weights and biases of each layer in turn
 void nnet_load(nnet& nn, const char* filename)
 {
+    format_reader r;
+    if (format_open(r, filename, FORMAT_NNET))
+    {
+        bool valid =
+            r.nsections() >= 4 && r.nsections() % 2 == 0 &&
+            format_read_array1d(r, 0, nn.input_mean) &&
+            format_read_array1d(r, 1, nn.input_std) &&
+            format_read_array1d(r, 2, nn.output_mean) &&
+            format_read_array1d(r, 3, nn.output_std);
+
+        int count = (r.nsections() - 4) / 2;
+
+        nn.weights.resize(count);
+        nn.biases.resize(count);
+
+        for (int i = 0; i < count; i++)
+        {
+            valid = valid &&
+                format_read_array2d(r, 4 + 2 * i + 0, nn.weights[i]) &&
+                format_read_array1d(r, 4 + 2 * i + 1, nn.biases[i]);
+        }
+
+        assert(valid);
+        format_close(r);
+        return;
+    }
+
+    if (r.invalid)
+    {
+        return;
+    }
+
+    // Original format
     FILE* f = fopen(filename, "rb");
     assert(f != NULL);
 
@@ -41,6 +77,26 @@ void nnet_load(nnet& nn, const char* filename)
     fclose(f);
 }
 
+void nnet_save(const nnet& nn, const char* filename)
+{
+    format_writer w;
+    bool opened = format_write_begin(w, filename, FORMAT_NNET, 4 + 2 * (int)nn.weights.size());
+    assert(opened);
+
+    format_write_array1d(w, nn.input_mean);
+    format_write_array1d(w, nn.input_std);
+    format_write_array1d(w, nn.output_mean);
+    format_write_array1d(w, nn.output_std);
+
+    for (int i = 0; i < (int)nn.weights.size(); i++)
+    {
+        format_write_array2d(w, nn.weights[i]);
+        format_write_array1d(w, nn.biases[i]);
+    }
+
+    format_write_end(w);
+}
+
 
 
 //--------------------------------------
@@ -47,6 +47,10 @@ struct nnet
 
 void nnet_load(nnet& nn, const char* filename);
 
+// Save in the versioned format of MMformat.h, which `nnet_load`
+// reads as well as the original one
+void nnet_save(const nnet& nn, const char* filename);
+
 //--------------------------------------
 
 static inline void nnet_layer_normalize(
@@ -0,0 +1,416 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "MMpager.h"
+#include "MMformat.h"
+
+#include "HAL/PlatformFileManager.h"
+#include "HAL/PlatformProcess.h"
+#include "Async/Async.h"
+#include "Misc/ScopeLock.h"
+
+#include <string.h>
+
+MMpager::MMpager()
+{
+}
+
+MMpager::~MMpager()
+{
+}
+
+
+//---------------------------------------------------------------
+pose_pager::~pose_pager()
+{
+    pose_pager_close(*this);
+}
+
+// Find the pose arrays in a file of the original format, where each
+// array is stored as its number of rows and columns then its data
+static bool pose_pager_find_original(pose_pager& pager, IFileHandle* handle, int& rows, int& cols)
+{
+    const int64 sizes[4] = { sizeof(vec3), sizeof(vec3), sizeof(quat), sizeof(vec3) };
+
+    int64 offset = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int shape[2];
+        if (!handle->Seek(offset) || !handle->Read((uint8*)shape, sizeof(shape)))
+        {
+            return false;
+        }
+
+        if (i > 0 && (shape[0] != rows || shape[1] != cols))
+        {
+            return false;
+        }
+
+        rows = shape[0];
+        cols = shape[1];
+        pager.offsets[i] = offset + sizeof(shape);
+        offset = pager.offsets[i] + (int64)rows * cols * sizes[i];
+    }
+
+    return offset <= handle->Size();
+}
+
+bool pose_pager_open(
+    pose_pager& pager,
+    const char* filename,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const int nbones,
+    const size_t budget)
+{
+    pose_pager_close(pager);
+
+    int rows = 0, cols = 0;
+
+    format_reader r;
+    if (format_open(r, filename, FORMAT_DATABASE))
+    {
+        const int types[4] = { FORMAT_TYPE_VEC3, FORMAT_TYPE_VEC3, FORMAT_TYPE_QUAT, FORMAT_TYPE_VEC3 };
+
+        bool valid = r.nsections() >= 4;
+        for (int i = 0; valid && i < 4; i++)
+        {
+            const format_section& s = r.sections(i);
+            valid = (int)s.type == types[i] && (i == 0 || (s.rows == rows && s.cols == cols));
+            rows = (int)s.rows;
+            cols = (int)s.cols;
+            pager.offsets[i] = s.offset;
+        }
+
+        format_close(r);
+
+        if (!valid)
+        {
+            return false;
+        }
+    }
+    else if (r.invalid)
+    {
+        return false;
+    }
+    else
+    {
+        IFileHandle* handle = FPlatformFileManager::Get().GetPlatformFile().OpenRead(ANSI_TO_TCHAR(filename));
+        if (handle == NULL)
+        {
+            return false;
+        }
+
+        bool valid = pose_pager_find_original(pager, handle, rows, cols);
+        delete handle;
+
+        if (!valid)
+        {
+            return false;
+        }
+    }
+
+    if (cols != nbones || (range_stops.size > 0 && range_stops(range_stops.size - 1) > rows))
+    {
+        return false;
+    }
+
+    pager.filename = filename;
+    pager.nbones = nbones;
+    pager.range_starts = range_starts;
+    pager.range_stops = range_stops;
+    pager.pages.resize(range_starts.size);
+    pager.pages.set(NULL);
+    pager.loading.resize(range_starts.size);
+    pager.loading.set(false);
+    pager.budget = budget;
+    pager.resident = 0;
+    pager.clock = 0;
+    pager.hits = 0;
+    pager.misses = 0;
+    pager.evictions = 0;
+    pager.prefetches = 0;
+    pager.waits = 0;
+    pager.failures = 0;
+
+    return true;
+}
+
+void pose_pager_close(pose_pager& pager)
+{
+    while (pager.inflight > 0)
+    {
+        FPlatformProcess::Sleep(0.001f);
+    }
+
+    for (int i = 0; i < pager.pages.size; i++)
+    {
+        delete pager.pages(i);
+    }
+
+    pager.pages.resize(0);
+    pager.loading.resize(0);
+    pager.range_starts.resize(0);
+    pager.range_stops.resize(0);
+    pager.resident = 0;
+}
+
+//---------------------------------------------------------------
+template<typename T>
+static bool pose_pager_read_rows(IFileHandle* handle, array2d<T>& arr, const uint64_t offset, const int start, const int rows, const int cols)
+{
+    arr.resize(rows, cols);
+    return
+        handle->Seek((int64)(offset + (uint64_t)start * cols * sizeof(T))) &&
+        handle->Read((uint8*)arr.data, (int64)rows * cols * sizeof(T));
+}
+
+// Read a range from the file. Done without holding the lock so that
+// readers of other ranges are never blocked on the disk. Returns NULL
+// if the file can no longer be opened or read, such as when it was
+// deleted or replaced by a shorter one while playing.
+static pose_pager_page* pose_pager_load(const pose_pager& pager, const int range)
+{
+    IFileHandle* handle = FPlatformFileManager::Get().GetPlatformFile().OpenRead(*pager.filename);
+    if (handle == NULL)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Could not open %s to page in range %d"), *pager.filename, range);
+        return NULL;
+    }
+
+    pose_pager_page* page = new pose_pager_page();
+    page->range = range;
+    page->start = pager.range_starts(range);
+
+    int rows = pager.range_stops(range) - page->start;
+
+    bool valid =
+        pose_pager_read_rows(handle, page->bone_positions, pager.offsets[0], page->start, rows, pager.nbones) &&
+        pose_pager_read_rows(handle, page->bone_velocities, pager.offsets[1], page->start, rows, pager.nbones) &&
+        pose_pager_read_rows(handle, page->bone_rotations, pager.offsets[2], page->start, rows, pager.nbones) &&
+        pose_pager_read_rows(handle, page->bone_angular_velocities, pager.offsets[3], page->start, rows, pager.nbones);
+
+    delete handle;
+
+    if (!valid)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Could not read range %d from %s to page it in"), range, *pager.filename);
+        delete page;
+        return NULL;
+    }
+
+    return page;
+}
+
+// Make a page resident, evicting the least recently used others
+// until back within the budget. Returns the resident page of the
+// range, which may have been read in by another thread meanwhile.
+// The lock must be held.
+static pose_pager_page* pose_pager_insert(pose_pager& pager, pose_pager_page* page)
+{
+    pose_pager_page* resident = pager.pages(page->range);
+    if (resident != NULL)
+    {
+        delete page;
+        return resident;
+    }
+
+    pager.pages(page->range) = page;
+    pager.resident += page->bytes();
+    page->last_used = ++pager.clock;
+
+    while (pager.resident > pager.budget)
+    {
+        int oldest = -1;
+        for (int i = 0; i < pager.pages.size; i++)
+        {
+            if (pager.pages(i) != NULL && pager.pages(i) != page &&
+                (oldest == -1 || pager.pages(i)->last_used < pager.pages(oldest)->last_used))
+            {
+                oldest = i;
+            }
+        }
+
+        // A single range larger than the budget stays in memory alone
+        if (oldest == -1)
+        {
+            break;
+        }
+
+        pager.resident -= pager.pages(oldest)->bytes();
+        delete pager.pages(oldest);
+        pager.pages(oldest) = NULL;
+        pager.evictions++;
+    }
+
+    return page;
+}
+
+// Get the resident page of a range, reading it in if needed. If the
+// range is already being read in, by a prefetch or another reader, 
+// this waits for it rather than reading it a second time. The lock 
+// must be held, and is released while waiting or reading. Returns
+// NULL if the range could not be read in.
+static pose_pager_page* pose_pager_acquire(pose_pager& pager, const int range)
+{
+    pose_pager_page* page = pager.pages(range);
+
+    if (page != NULL)
+    {
+        pager.hits++;
+    }
+    else
+    {
+        pager.misses++;
+
+        // The page can be evicted again before we get to it
+        // when the budget is tight, hence the loop
+        while (page == NULL)
+        {
+            if (pager.loading(range))
+            {
+                pager.waits++;
+
+                FScopeUnlock unlock(&pager.lock);
+                FPlatformProcess::Sleep(0.0f);
+            }
+            else
+            {
+                pager.loading(range) = true;
+
+                pose_pager_page* loaded;
+                {
+                    FScopeUnlock unlock(&pager.lock);
+                    loaded = pose_pager_load(pager, range);
+                }
+
+                pager.loading(range) = false;
+
+                if (loaded == NULL)
+                {
+                    pager.failures++;
+                    return NULL;
+                }
+
+                pose_pager_insert(pager, loaded);
+            }
+
+            page = pager.pages(range);
+        }
+    }
+
+    page->last_used = ++pager.clock;
+
+    return page;
+}
+
+bool pose_pager_read(
+    pose_pager& pager,
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const int range,
+    const int frame)
+{
+    FScopeLock lock(&pager.lock);
+
+    pose_pager_page* page = pose_pager_acquire(pager, range);
+    if (page == NULL)
+    {
+        return false;
+    }
+
+    int row = frame - page->start;
+    assert(row >= 0 && row < page->bone_positions.rows);
+
+    size_t bytes = pager.nbones * sizeof(vec3);
+    if (bone_positions.size > 0) { memcpy(bone_positions.data, &page->bone_positions(row, 0), bytes); }
+    if (bone_velocities.size > 0) { memcpy(bone_velocities.data, &page->bone_velocities(row, 0), bytes); }
+    if (bone_rotations.size > 0) { memcpy(bone_rotations.data, &page->bone_rotations(row, 0), pager.nbones * sizeof(quat)); }
+    if (bone_angular_velocities.size > 0) { memcpy(bone_angular_velocities.data, &page->bone_angular_velocities(row, 0), bytes); }
+
+    return true;
+}
+
+bool pose_pager_read_interpolated(
+    pose_pager& pager,
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const int range,
+    const int frame,
+    const int next,
+    const float alpha)
+{
+    FScopeLock lock(&pager.lock);
+
+    pose_pager_page* page = pose_pager_acquire(pager, range);
+    if (page == NULL)
+    {
+        return false;
+    }
+
+    int row0 = frame - page->start;
+    int row1 = next - page->start;
+    assert(row0 >= 0 && row0 < page->bone_positions.rows);
+    assert(row1 >= 0 && row1 < page->bone_positions.rows);
+
+    for (int b = 0; b < pager.nbones; b++)
+    {
+        if (bone_positions.size > 0) { bone_positions(b) = lerp(page->bone_positions(row0, b), page->bone_positions(row1, b), alpha); }
+        if (bone_velocities.size > 0) { bone_velocities(b) = lerp(page->bone_velocities(row0, b), page->bone_velocities(row1, b), alpha); }
+        if (bone_rotations.size > 0) { bone_rotations(b) = quat_nlerp_shortest(page->bone_rotations(row0, b), page->bone_rotations(row1, b), alpha); }
+        if (bone_angular_velocities.size > 0) { bone_angular_velocities(b) = lerp(page->bone_angular_velocities(row0, b), page->bone_angular_velocities(row1, b), alpha); }
+    }
+
+    return true;
+}
+
+void pose_pager_prefetch(pose_pager& pager, const int range)
+{
+    {
+        FScopeLock lock(&pager.lock);
+
+        if (pager.pages(range) != NULL || pager.loading(range))
+        {
+            return;
+        }
+
+        pager.loading(range) = true;
+        pager.prefetches++;
+        pager.inflight++;
+    }
+
+    // Closing the pager waits for this so the pointer stays valid
+    pose_pager* target = &pager;
+
+    Async(EAsyncExecution::ThreadPool, [target, range]()
+    {
+        pose_pager_page* loaded = pose_pager_load(*target, range);
+
+        {
+            FScopeLock lock(&target->lock);
+
+            if (loaded != NULL)
+            {
+                pose_pager_insert(*target, loaded);
+            }
+            else
+            {
+                target->failures++;
+            }
+
+            target->loading(range) = false;
+        }
+
+        target->inflight--;
+    });
+}
+
+bool pose_pager_resident(pose_pager& pager, const int range)
+{
+    FScopeLock lock(&pager.lock);
+    return pager.pages(range) != NULL;
+}
@@ -0,0 +1,132 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+
+#include "MMvec.h"
+#include "MMquat.h"
+#include "MMarray.h"
+
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+
+#include <atomic>
+
+/**
+ * 
+ */
+class MOTIONMATCHING_API MMpager
+{
+public:
+	MMpager();
+	~MMpager();
+};
+
+
+//---------------------------------------------------------------
+
+// Pose data of one range read in from the database file
+struct pose_pager_page
+{
+    int range = -1;
+    int start = 0;
+
+    array2d<vec3> bone_positions;
+    array2d<vec3> bone_velocities;
+    array2d<quat> bone_rotations;
+    array2d<vec3> bone_angular_velocities;
+
+    uint64_t last_used = 0;
+
+    size_t bytes() const { return (size_t)bone_positions.rows * bone_positions.cols * (3 * sizeof(vec3) + sizeof(quat)); }
+};
+
+// Reads the pose data of a database in from its file one range at a
+// time when a frame of that range is first needed, keeping the
+// ranges read most recently in memory up to a budget in bytes.
+// Reading and prefetching can be done from any thread.
+struct pose_pager
+{
+    FString filename;
+    int nbones = 0;
+
+    // Offset in the file of the first frame of the positions,
+    // velocities, rotations and angular velocities
+    uint64_t offsets[4] = { 0, 0, 0, 0 };
+
+    array1d<int> range_starts;
+    array1d<int> range_stops;
+
+    // Page of each range, NULL when it isn't in memory, and whether
+    // it is being read in by a prefetch or a reader
+    array1d<pose_pager_page*> pages;
+    array1d<bool> loading;
+
+    size_t budget = 0;
+    size_t resident = 0;
+    uint64_t clock = 0;
+
+    int hits = 0;
+    int misses = 0;
+    int evictions = 0;
+    int prefetches = 0;
+    int waits = 0;
+    int failures = 0;
+
+    FCriticalSection lock;
+    std::atomic<int> inflight{ 0 };
+
+    pose_pager() {}
+    ~pose_pager();
+
+    pose_pager(const pose_pager&) = delete;
+    pose_pager& operator=(const pose_pager&) = delete;
+};
+
+// Open a database file in the original or versioned format for
+// paging. Returns false if it can't be read or doesn't contain the
+// given ranges and number of bones.
+bool pose_pager_open(
+    pose_pager& pager,
+    const char* filename,
+    const slice1d<int> range_starts,
+    const slice1d<int> range_stops,
+    const int nbones,
+    const size_t budget);
+
+// Free all pages, first waiting for any prefetches to finish
+void pose_pager_close(pose_pager& pager);
+
+// Copy the pose of a frame of the given range, reading the range in
+// if needed. Empty outputs are skipped. Returns false, leaving the 
+// outputs unchanged, if the range could not be read in.
+bool pose_pager_read(
+    pose_pager& pager,
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const int range,
+    const int frame);
+
+// Interpolate the pose between a frame and the next of the given
+// range, reading both from the page at once. Empty outputs are skipped.
+// Returns false, leaving the outputs unchanged, if the range could not
+// be read in.
+bool pose_pager_read_interpolated(
+    pose_pager& pager,
+    slice1d<vec3> bone_positions,
+    slice1d<vec3> bone_velocities,
+    slice1d<quat> bone_rotations,
+    slice1d<vec3> bone_angular_velocities,
+    const int range,
+    const int frame,
+    const int next,
+    const float alpha);
+
+// Start reading a range in on a worker thread if it isn't in memory
+void pose_pager_prefetch(pose_pager& pager, const int range);
+
+// If a range is currently in memory
+bool pose_pager_resident(pose_pager& pager, const int range);
@@ -24,6 +24,7 @@
 #include "Grabber.h" //Grab
 
 #include "Components/PoseableMeshComponent.h"
+#include "Async/Async.h"
 
 
 
@@ -113,15 +114,39 @@ void AMotionMatchingCharacter::BeginPlay()
 	//Character skeleton ⺻ vector  迭 
 	SaveBasicVectors();
 
-	//MotionMatching BeginPlay
+	//MotionMatching BeginPlay (data is loaded in the background)
 	MotionMatchingMainBeginPlay();
 
-	//SetCharacterPositionRest();
-	SetCharacterRotationRest();
+}
+
+void AMotionMatchingCharacter::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (Record_queries && Motion_matching_ready && Recorded_queries.Num() > 0)
+	{
+		int Nfeatures = Asset->db.nfeatures();
+
+		array2d<float> Queries(Recorded_queries.Num() / Nfeatures, Nfeatures);
+		memcpy(Queries.data, Recorded_queries.GetData(), Queries.rows * Queries.cols * sizeof(float));
+
+		FString QueriesPath = FPaths::ProjectContentDir() + TEXT("/queries.bin");
+		FILE* f = fopen(TCHAR_TO_ANSI(*QueriesPath), "wb");
+		if (f != NULL)
+		{
+			array2d_write(Queries, f);
+			fclose(f);
+		}
+
+		Recorded_queries.Empty();
+	}
 
-	//DataBase Log
-	DataBaseLog();
+	// The data is freed with the last character holding it
+	Asset.Reset();
+	Reload_asset.Reset();
+	Reload_loading = TSharedFuture<void>();
+	Reload_searching = false;
+	Motion_matching_ready = false;
 
+	Super::EndPlay(EndPlayReason);
 }
 
 
@@ -148,6 +173,32 @@ void AMotionMatchingCharacter::Tick(float DeltaTime) {
 
 	SetInputZero(); //Input value ʱȭ
 
+	// Hold the T-pose until the data loaded in the background is ready
+	if (!Motion_matching_ready)
+	{
+		if (!Asset_loading.IsValid() || !Asset_loading.IsReady())
+		{
+			return;
+		}
+
+		//MotionMatching Ready
+		MotionMatchingMainReady();
+
+		//SetCharacterPositionRest();
+		SetCharacterRotationRest();
+
+		//DataBase Log
+		DataBaseLog();
+
+		OnMotionMatchingReady.Broadcast(Load_time);
+	}
+
+	// Reloaded data is only swapped in between ticks of the old one
+	if (Reload_asset.IsValid())
+	{
+		MotionMatchingReloadTick();
+	}
+
 	MotionMatchingMainTick();
 
 	//UI
@@ -561,30 +612,52 @@ FVector AMotionMatchingCharacter::To_Vector3(vec3 v)
 													
 
 void AMotionMatchingCharacter::Draw_features(const slice1d<float> features, const vec3 pos, const quat rot, FColor color)
-{												
-	vec3 lfoot_pos = quat_mul_vec3(rot, vec3(features(0), features(1), features(2))) + pos;
-	vec3 rfoot_pos = quat_mul_vec3(rot, vec3(features(3), features(4), features(5))) + pos;
-	vec3 lfoot_vel = quat_mul_vec3(rot, vec3(features(6), features(7), features(8)));
-	vec3 rfoot_vel = quat_mul_vec3(rot, vec3(features(9), features(10), features(11)));
-	//vec3 hip_vel   = quat_mul_vec3(rot, vec3(features(12), features(13), features(14)));
-	vec3 traj0_pos = quat_mul_vec3(rot, vec3(features(15), 0.0f, features(16))) + pos;
-	vec3 traj1_pos = quat_mul_vec3(rot, vec3(features(17), 0.0f, features(18))) + pos;
-	vec3 traj2_pos = quat_mul_vec3(rot, vec3(features(19), 0.0f, features(20))) + pos;
-	vec3 traj0_dir = quat_mul_vec3(rot, vec3(features(21), 0.0f, features(22)));
-	vec3 traj1_dir = quat_mul_vec3(rot, vec3(features(23), 0.0f, features(24)));
-	vec3 traj2_dir = quat_mul_vec3(rot, vec3(features(25), 0.0f, features(26)));
-
-	DrawDebugSphere(GetWorld(), To_Vector3(lfoot_pos), 5.0f, 8, color);
-	DrawDebugSphere(GetWorld(), To_Vector3(rfoot_pos), 5.0f, 8, color);
-	DrawDebugSphere(GetWorld(), To_Vector3(traj0_pos), 5.0f, 8, color);
-	DrawDebugSphere(GetWorld(), To_Vector3(traj1_pos), 5.0f, 8, color);
-	DrawDebugSphere(GetWorld(), To_Vector3(traj2_pos), 5.0f, 8, color);
-
-	DrawDebugLine(GetWorld(), To_Vector3(lfoot_pos), To_Vector3(lfoot_pos + 0.1f * lfoot_vel), color);
-	DrawDebugLine(GetWorld(), To_Vector3(rfoot_pos), To_Vector3(rfoot_pos + 0.1f * rfoot_vel), color);
-	DrawDebugLine(GetWorld(), To_Vector3(traj0_pos), To_Vector3(traj0_pos + 0.1f * traj0_dir), color);
-	DrawDebugLine(GetWorld(), To_Vector3(traj1_pos), To_Vector3(traj1_pos + 0.1f * traj1_dir), color);
-	DrawDebugLine(GetWorld(), To_Vector3(traj2_pos), To_Vector3(traj2_pos + 0.1f * traj2_dir), color);
+{
+	const database& DB = Asset->db;
+
+	int offset = 0;
+	for (int c = 0; c < DB.schema.nchannels(); c++)
+	{
+		const feature_channel& channel = DB.schema.channels(c);
+
+		if (channel.type == FEATURE_BONE_POSITION)
+		{
+			vec3 bone_pos = quat_mul_vec3(rot, vec3(features(offset + 0), features(offset + 1), features(offset + 2))) + pos;
+
+			DrawDebugSphere(GetWorld(), To_Vector3(bone_pos), 5.0f, 8, color);
+
+			// Draw the velocity of the same bone from its position
+			int vel_offset;
+			if (feature_schema_find(vel_offset, DB.schema, FEATURE_BONE_VELOCITY, channel.bone) != -1)
+			{
+				vec3 bone_vel = quat_mul_vec3(rot, vec3(features(vel_offset + 0), features(vel_offset + 1), features(vel_offset + 2)));
+
+				DrawDebugLine(GetWorld(), To_Vector3(bone_pos), To_Vector3(bone_pos + 0.1f * bone_vel), color);
+			}
+		}
+		else if (channel.type == FEATURE_TRAJECTORY_POSITION)
+		{
+			int dir_offset;
+			int dir_channel = feature_schema_find(dir_offset, DB.schema, FEATURE_TRAJECTORY_DIRECTION, channel.bone);
+
+			for (int s = 0; s < channel.noffsets; s++)
+			{
+				vec3 traj_pos = quat_mul_vec3(rot, vec3(features(offset + 2 * s + 0), 0.0f, features(offset + 2 * s + 1))) + pos;
+
+				DrawDebugSphere(GetWorld(), To_Vector3(traj_pos), 5.0f, 8, color);
+
+				// Draw the direction at the same sample from its position
+				if (dir_channel != -1 && s < DB.schema.channels(dir_channel).noffsets)
+				{
+					vec3 traj_dir = quat_mul_vec3(rot, vec3(features(dir_offset + 2 * s + 0), 0.0f, features(dir_offset + 2 * s + 1)));
+
+					DrawDebugLine(GetWorld(), To_Vector3(traj_pos), To_Vector3(traj_pos + 0.1f * traj_dir), color);
+				}
+			}
+		}
+
+		offset += channel.size();
+	}
 }
 
 void AMotionMatchingCharacter::Draw_trajectory(const slice1d<vec3> trajectory_positions, const slice1d<quat> trajectory_rotations, FColor color)
@@ -1048,48 +1121,75 @@ void AMotionMatchingCharacter::query_copy_denormalized_feature(
 	offset += size;
 }
 
+// The predicted trajectory is sampled every third of a second, 
+// which is every 20 frames of a 60 Hz database, so offsets in 
+// between samples are linearly interpolated
+static const float Trajectory_sample_time = 20.0f / 60.0f;
+
+// Frames either side of the current one, and at the end of ranges,
+// which the search ignores. Also a third of a second.
+static const float Search_ignore_time = 20.0f / 60.0f;
+
+static void trajectory_sample_index(int& index, float& alpha, const int count, const int offset, const float frame_rate)
+{
+	float sample = offset / (frame_rate * Trajectory_sample_time);
+	index = clamp((int)sample, 0, count - 2);
+	alpha = clampf(sample - index, 0.0f, 1.0f);
+}
+
 // Compute the query feature vector for the current 
 // trajectory controlled by the gamepad.
 void AMotionMatchingCharacter::query_compute_trajectory_position_feature(
 	slice1d<float> query,
 	int& offset,
+	const feature_channel& channel,
 	const vec3 root_position,
 	const quat root_rotation,
 	const slice1d<vec3> trajectory_positions)
 {
-	vec3 traj0 = quat_inv_mul_vec3(root_rotation, trajectory_positions(1) - root_position);
-	vec3 traj1 = quat_inv_mul_vec3(root_rotation, trajectory_positions(2) - root_position);
-	vec3 traj2 = quat_inv_mul_vec3(root_rotation, trajectory_positions(3) - root_position);
+	for (int s = 0; s < channel.noffsets; s++)
+	{
+		int index;
+		float alpha;
+		trajectory_sample_index(index, alpha, trajectory_positions.size, channel.offsets[s], Asset->db.frame_rate);
 
-	query(offset + 0) = traj0.x;
-	query(offset + 1) = traj0.z;
-	query(offset + 2) = traj1.x;
-	query(offset + 3) = traj1.z;
-	query(offset + 4) = traj2.x;
-	query(offset + 5) = traj2.z;
+		vec3 trajectory_position = alpha == 0.0f ? trajectory_positions(index) :
+			lerp(trajectory_positions(index), trajectory_positions(index + 1), alpha);
 
-	offset += 6;
+		vec3 traj = quat_inv_mul_vec3(root_rotation, trajectory_position - root_position);
+
+		query(offset + 2 * s + 0) = traj.x;
+		query(offset + 2 * s + 1) = traj.z;
+	}
+
+	offset += channel.size();
 }
 
 // Same but for the trajectory direction
 void AMotionMatchingCharacter::query_compute_trajectory_direction_feature(
 	slice1d<float> query,
 	int& offset,
+	const feature_channel& channel,
 	const quat root_rotation,
 	const slice1d<quat> trajectory_rotations)
 {
-	vec3 traj0 = quat_inv_mul_vec3(root_rotation, quat_mul_vec3(trajectory_rotations(1), vec3(0, 0, 1)));
-	vec3 traj1 = quat_inv_mul_vec3(root_rotation, quat_mul_vec3(trajectory_rotations(2), vec3(0, 0, 1)));
-	vec3 traj2 = quat_inv_mul_vec3(root_rotation, quat_mul_vec3(trajectory_rotations(3), vec3(0, 0, 1)));
+	for (int s = 0; s < channel.noffsets; s++)
+	{
+		int index;
+		float alpha;
+		trajectory_sample_index(index, alpha, trajectory_rotations.size, channel.offsets[s], Asset->db.frame_rate);
 
-	query(offset + 0) = traj0.x;
-	query(offset + 1) = traj0.z;
-	query(offset + 2) = traj1.x;
-	query(offset + 3) = traj1.z;
-	query(offset + 4) = traj2.x;
-	query(offset + 5) = traj2.z;
+		quat trajectory_rotation = alpha == 0.0f ? trajectory_rotations(index) :
+			alpha == 1.0f ? trajectory_rotations(index + 1) :
+			quat_nlerp_shortest(trajectory_rotations(index), trajectory_rotations(index + 1), alpha);
 
-	offset += 6;
+		vec3 traj = quat_inv_mul_vec3(root_rotation, quat_mul_vec3(trajectory_rotation, vec3(0, 0, 1)));
+
+		query(offset + 2 * s + 0) = traj.x;
+		query(offset + 2 * s + 1) = traj.z;
+	}
+
+	offset += channel.size();
 }
 
 
@@ -1646,54 +1746,124 @@ void AMotionMatchingCharacter::MotionMatchingMainBeginPlay() {
 	GetObstaclesinfo();
 
 
-	// Character
-	
-	FString CharacterFilePath = FPaths::ProjectContentDir() + TEXT("/character.bin");
-	const char* CharacterFilePathChar = TCHAR_TO_ANSI(*CharacterFilePath); 	// TCHAR_TO_ANSI ũθ Ͽ ȯ
-	character_load(Character_data, CharacterFilePathChar);
+	// Use the standard feature layout unless one was set up already
 
+	if (Feature_schema.nchannels() == 0)
+	{
+		feature_schema_default(
+			Feature_schema,
+			Feature_weight_foot_position,
+			Feature_weight_foot_velocity,
+			Feature_weight_hip_velocity,
+			Feature_weight_trajectory_positions,
+			Feature_weight_trajectory_directions,
+			Database_frame_rate);
+	}
+
+
+	// Load Character, Animation Data and Networks and build Matching 
+	// Database on worker threads, or share them with the characters 
+	// which already loaded them with the same settings. Everything
+	// depending on them is initialized in MotionMatchingMainReady.
+
+	motion_matching_asset_settings Settings;
+	Settings.directory = FPaths::ProjectContentDir();
+	Settings.schema = Feature_schema;
+	Settings.reorder_frames = Feature_reorder_frames;
+	Settings.memory_mapped = Database_memory_mapped;
+	Settings.huge_pages = Database_huge_pages;
+	Settings.compress_poses = Database_compress_poses;
+	Settings.derive_velocities = Database_derive_velocities;
+	Settings.page_poses = Database_page_poses;
+	Settings.page_budget = (size_t)Database_page_budget_mb << 20;
+	Settings.prune_feature_tolerance = Database_prune_tolerance;
+	Settings.prune_ignore_frames = (int)(Search_ignore_time * Database_frame_rate + 0.5f);
+	Settings.mirror = Database_mirror;
+	Settings.contact_bones.resize(2);
+	Settings.contact_bones(0) = Bone_LeftToe;
+	Settings.contact_bones(1) = Bone_RightToe;
+	Settings.frame_rate = Database_frame_rate;
+#if WITH_EDITOR
+	// Only bake in the editor so that packaged builds never write to disk
+	Settings.save_baked = true;
+#endif
+
+	// Files mapped or paged from can't be overwritten while in use
+	if (Database_hot_reload)
+	{
+		Settings.memory_mapped = false;
+		Settings.page_poses = false;
+	}
 
-	// Load Animation Data
+	Load_start_time = FPlatformTime::Seconds();
+	Motion_matching_ready = false;
 
-	FString DatabaseFilePath = FPaths::ProjectContentDir() + TEXT("/database.bin");
-	const char* DatabaseFilePathChar = TCHAR_TO_ANSI(*DatabaseFilePath); 	// TCHAR_TO_ANSI ũθ Ͽ ȯ
-	database_load(DB, DatabaseFilePathChar);
+	Asset_settings = Settings;
+	Asset = motion_matching_asset_acquire(Asset_loading, Settings);
 
-	// build Matching Database
-	database_build_matching_features(
-		DB,
-		Feature_weight_foot_position,
-		Feature_weight_foot_velocity,
-		Feature_weight_hip_velocity,
-		Feature_weight_trajectory_positions,
-		Feature_weight_trajectory_directions);
 
+	// Trajectory & Gameplay Data
+	Search_timer = Search_time;
+	Force_search_timer = Search_time;
 
-	FString FeaturesFilePath = FPaths::ProjectContentDir() + TEXT("/features.bin");
-	const char* FeaturesFilePathChar = TCHAR_TO_ANSI(*FeaturesFilePath); 	// TCHAR_TO_ANSI ũθ Ͽ ȯ
-	database_save_matching_features(DB, FeaturesFilePathChar);
+	// Synchronization
+	Synchronization_enabled = false;
 
+	// Adjustment
+	Adjustment_enabled = true;
+	Adjustment_by_velocity_enabled = true;
 
-	// Pose & Inertializer Data
+	// Clamping
+	Clamping_enabled = true;
 
-	Frame_index = DB.range_starts(0);
+	// IK
+	Ik_enabled = true;
+
+	// Learned Motion Matching
+	//LMM_enabled = false;
+	LMM_enabled = true;
+	LMM_hybrid_enabled = true;
+
+}
 
-	Curr_bone_positions = DB.bone_positions(Frame_index);
-	Curr_bone_velocities = DB.bone_velocities(Frame_index);
-	Curr_bone_rotations = DB.bone_rotations(Frame_index);
-	Curr_bone_angular_velocities = DB.bone_angular_velocities(Frame_index);
-	Curr_bone_contacts = DB.contact_states(Frame_index);
+void AMotionMatchingCharacter::MotionMatchingMainReady() {
 
-	Trns_bone_positions = DB.bone_positions(Frame_index);
-	Trns_bone_velocities = DB.bone_velocities(Frame_index);
-	Trns_bone_rotations = DB.bone_rotations(Frame_index);
-	Trns_bone_angular_velocities = DB.bone_angular_velocities(Frame_index);
-	Trns_bone_contacts = DB.contact_states(Frame_index);
+	const database& DB = Asset->db;
 
-	Bone_positions = DB.bone_positions(Frame_index);
-	Bone_velocities = DB.bone_velocities(Frame_index);
-	Bone_rotations = DB.bone_rotations(Frame_index);
-	Bone_angular_velocities = DB.bone_angular_velocities(Frame_index); 
+	Load_time = (float)(FPlatformTime::Seconds() - Load_start_time);
+	Motion_matching_ready = true;
+
+	UE_LOG(LogTemp, Log, TEXT("Motion matching ready in %f ms (character %f ms, database %f ms, networks %f ms, baked features %s, %d shared assets)"),
+		1000.0f * Load_time, 
+		1000.0 * Asset->timing.character, 
+		1000.0 * Asset->timing.database, 
+		1000.0 * Asset->timing.networks, 
+		Asset->timing.baked_loaded ? TEXT("loaded") : TEXT("rebuilt"),
+		motion_matching_asset_count());
+
+
+	// Pose & Inertializer Data
+
+	Frame_index = DB.range_starts(0);
+
+	Curr_bone_positions.resize(DB.nbones());
+	Curr_bone_velocities.resize(DB.nbones());
+	Curr_bone_rotations.resize(DB.nbones());
+	Curr_bone_angular_velocities.resize(DB.nbones());
+	database_pose(Curr_bone_positions, Curr_bone_velocities, Curr_bone_rotations, Curr_bone_angular_velocities, DB, Frame_index);
+	Curr_bone_contacts.resize(DB.ncontacts());
+	database_contacts(Curr_bone_contacts, DB, Frame_index);
+
+	Trns_bone_positions = Curr_bone_positions;
+	Trns_bone_velocities = Curr_bone_velocities;
+	Trns_bone_rotations = Curr_bone_rotations;
+	Trns_bone_angular_velocities = Curr_bone_angular_velocities;
+	Trns_bone_contacts = Curr_bone_contacts;
+
+	Bone_positions = Curr_bone_positions;
+	Bone_velocities = Curr_bone_velocities;
+	Bone_rotations = Curr_bone_rotations;
+	Bone_angular_velocities = Curr_bone_angular_velocities; 
 
 	Bone_offset_positions = array1d<vec3>(DB.nbones());
 	Bone_offset_velocities = array1d<vec3>(DB.nbones());
@@ -1727,10 +1897,10 @@ void AMotionMatchingCharacter::MotionMatchingMainBeginPlay() {
 		Bone_offset_velocities,
 		Bone_offset_rotations,
 		Bone_offset_angular_velocities,
-		DB.bone_positions(Frame_index),
-		DB.bone_velocities(Frame_index),
-		DB.bone_rotations(Frame_index),
-		DB.bone_angular_velocities(Frame_index),
+		Curr_bone_positions,
+		Curr_bone_velocities,
+		Curr_bone_rotations,
+		Curr_bone_angular_velocities,
 		Transition_src_position,
 		Transition_src_rotation,
 		Transition_dst_position,
@@ -1739,23 +1909,6 @@ void AMotionMatchingCharacter::MotionMatchingMainBeginPlay() {
 		0.0f);
 
 
-	// Trajectory & Gameplay Data
-	Search_timer = Search_time;
-	Force_search_timer = Search_time;
-
-	// Synchronization
-	Synchronization_enabled = false;
-
-	// Adjustment
-	Adjustment_enabled = true;
-	Adjustment_by_velocity_enabled = true;
-
-	// Clamping
-	Clamping_enabled = true;
-
-	// IK
-	Ik_enabled = true;
-
 	// Contact and Foot Locking data
 	Contact_bones(0) = Bone_LeftToe; //Bone_LegtToe   index (enum)
 	Contact_bones(1) = Bone_RightToe;
@@ -1798,21 +1951,9 @@ void AMotionMatchingCharacter::MotionMatchingMainBeginPlay() {
 
 
 	// Learned Motion Matching
-	//LMM_enabled = false;
-	LMM_enabled = true;
-
-
-	FString DecompressorPath = FPaths::ProjectContentDir() + TEXT("/decompressor.bin");
-	FString StepperPath = FPaths::ProjectContentDir() + TEXT("/stepper.bin");
-	FString ProjectorPath = FPaths::ProjectContentDir() + TEXT("/projector.bin");
-
-	nnet_load(Decompressor, TCHAR_TO_ANSI(*DecompressorPath));
-	nnet_load(Stepper, TCHAR_TO_ANSI(*StepperPath));
-	nnet_load(Projector, TCHAR_TO_ANSI(*ProjectorPath));
-
-	Decompressor_evaluation.resize(Decompressor);
-	Stepper_evaluation.resize(Stepper);
-	Projector_evaluation.resize(Projector);
+	Decompressor_evaluation.resize(Asset->decompressor);
+	Stepper_evaluation.resize(Asset->stepper);
+	Projector_evaluation.resize(Asset->projector);
 
 	Features_proj = DB.features(Frame_index);
 	Features_curr = DB.features(Frame_index);
@@ -1822,10 +1963,25 @@ void AMotionMatchingCharacter::MotionMatchingMainBeginPlay() {
 
 
 
+}
+
+bool AMotionMatchingCharacter::IsMotionMatchingReady() const {
+
+	return Motion_matching_ready;
+}
+
+float AMotionMatchingCharacter::GetMotionMatchingLoadTime() const {
+
+	return Motion_matching_ready ? Load_time : 0.0f;
 }
 
 void AMotionMatchingCharacter::MotionMatchingMainTick() {
 
+	const database& DB = Asset->db;
+	const nnet& Decompressor = Asset->decompressor;
+	const nnet& Stepper = Asset->stepper;
+	const nnet& Projector = Asset->projector;
+
 	//Set Stamina
 	SetStamina(); //Walk or Run state 
 
@@ -1901,7 +2057,7 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 		gamepadstick_left,
 		gamepadstick_right,
 		Desired_strafe,
-		20.0f * DeltaT);
+		Trajectory_sample_time);
 
 	trajectory_rotations_predict(
 		Trajectory_rotations,
@@ -1910,7 +2066,7 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 		Simulation_angular_velocity,
 		Trajectory_desired_rotations,
 		Simulation_rotation_halflife,
-		20.0f * DeltaT);
+		Trajectory_sample_time);
 
 	trajectory_desired_velocities_predict(
 		Trajectory_desired_velocities,
@@ -1923,7 +2079,7 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 		simulation_fwrd_speed,
 		simulation_side_speed,
 		simulation_back_speed,
-		20.0f * DeltaT);
+		Trajectory_sample_time);
 
 	trajectory_positions_predict(
 		Trajectory_positions,
@@ -1934,7 +2090,7 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 		Simulation_acceleration,
 		Trajectory_desired_velocities,
 		Simulation_velocity_halflife,
-		20.0f * DeltaT,
+		Trajectory_sample_time,
 		Obstacles_positions,
 		Obstacles_scales);
 
@@ -1946,22 +2102,69 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 	array1d<float> query(DB.nfeatures());
 
 	// Compute the features of the query vector
-	slice1d<float> query_features = LMM_enabled ? slice1d<float>(Features_curr) : DB.features(Frame_index);
+	// The current frame can be a mirrored one so its features are copied
+	array1d<float> query_features(DB.nfeatures());
+	if (LMM_enabled)
+	{
+		query_features = Features_curr;
+	}
+	else
+	{
+		database_features(query_features, DB, Frame_index);
+	}
 
 	int offset = 0;
-	query_copy_denormalized_feature(query, offset, 3, query_features, DB.features_offset, DB.features_scale); // Left Foot Position
-	query_copy_denormalized_feature(query, offset, 3, query_features, DB.features_offset, DB.features_scale); // Right Foot Position
-	query_copy_denormalized_feature(query, offset, 3, query_features, DB.features_offset, DB.features_scale); // Left Foot Velocity
-	query_copy_denormalized_feature(query, offset, 3, query_features, DB.features_offset, DB.features_scale); // Right Foot Velocity
-	query_copy_denormalized_feature(query, offset, 3, query_features, DB.features_offset, DB.features_scale); // Hip Velocity
-	query_compute_trajectory_position_feature(query, offset, Bone_positions(0), Bone_rotations(0), Trajectory_positions);
-	query_compute_trajectory_direction_feature(query, offset, Bone_rotations(0), Trajectory_rotations);
+	for (int c = 0; c < DB.schema.nchannels(); c++)
+	{
+		const feature_channel& channel = DB.schema.channels(c);
+
+		switch (channel.type)
+		{
+		case FEATURE_BONE_POSITION:
+		case FEATURE_BONE_VELOCITY:
+			query_copy_denormalized_feature(query, offset, channel.size(), query_features, DB.features_offset, DB.features_scale);
+			break;
+		case FEATURE_TRAJECTORY_POSITION:
+			query_compute_trajectory_position_feature(query, offset, channel, Bone_positions(0), Bone_rotations(0), Trajectory_positions);
+			break;
+		case FEATURE_TRAJECTORY_DIRECTION:
+			query_compute_trajectory_direction_feature(query, offset, channel, Bone_rotations(0), Trajectory_rotations);
+			break;
+		}
+	}
 
 	assert(offset == DB.nfeatures());
 
+	int search_ignore_frames = (int)(Search_ignore_time * DB.frame_rate + 0.5f);
+
 	// Check if we reached the end of the current anim
 	bool end_of_anim = database_trajectory_index_clamp(DB, Frame_index, 1) == Frame_index; //MMdatabase ǵǾ 
 
+	// Continue a search which was spread over previous ticks. If
+	// we now need a result straight away it is abandoned instead.
+	bool search_finished = false;
+	int search_best_index = Frame_index;
+	int search_curr_index = Frame_index;
+
+	if (Search_pending)
+	{
+		if (LMM_enabled || force_search || end_of_anim)
+		{
+			Search_pending = false;
+		}
+		else if (database_search_continue(Search_cursor, DB, Search_work_budget, Search_time_budget))
+		{
+			Search_pending = false;
+			search_finished = true;
+			search_best_index = Search_cursor.best_index;
+			search_curr_index = Search_cursor.curr_index;
+		}
+		else if (Search_cursor.best_index != -1)
+		{
+			database_prefetch(DB, Search_cursor.best_index);
+		}
+	}
+
 	// Do we need to search?
 	if (force_search || Search_timer <= 0.0f || end_of_anim)
 	{
@@ -2031,54 +2234,91 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 				Latent_curr = Latent_proj;
 			}
 		}
-		else
+		else if (!Search_pending)
 		{
 			// Search
 
+			if (Record_queries)
+			{
+				Recorded_queries.Append(query.data, query.size);
+			}
+
 			int best_index = end_of_anim ? -1 : Frame_index;
 			float best_cost = FLT_MAX;
 
-			database_search(
-				best_index,
-				best_cost,
-				DB,
-				query,
-				0.0f,
-				20,
-				20);
-
-			// Transition if better frame found
+			uint32_t contact_filter = Search_require_contact ? (uint32_t)((1ull << DB.ncontacts()) - 1) : 0;
 
-			if (best_index != Frame_index)
+			// The bound from the projector usually makes the search cheap enough
+			// to finish straight away, so it is preferred to spreading it over ticks
+			if (LMM_hybrid_enabled)
 			{
-				Trns_bone_positions = DB.bone_positions(best_index);
-				Trns_bone_velocities = DB.bone_velocities(best_index);
-				Trns_bone_rotations = DB.bone_rotations(best_index);
-				Trns_bone_angular_velocities = DB.bone_angular_velocities(best_index);
-
-				inertialize_pose_transition(
-					Bone_offset_positions,
-					Bone_offset_velocities,
-					Bone_offset_rotations,
-					Bone_offset_angular_velocities,
-					Transition_src_position,
-					Transition_src_rotation,
-					Transition_dst_position,
-					Transition_dst_rotation,
-					Bone_positions(0),
-					Bone_velocities(0),
-					Bone_rotations(0),
-					Bone_angular_velocities(0),
-					Curr_bone_positions,
-					Curr_bone_velocities,
-					Curr_bone_rotations,
-					Curr_bone_angular_velocities,
-					Trns_bone_positions,
-					Trns_bone_velocities,
-					Trns_bone_rotations,
-					Trns_bone_angular_velocities);
+				projector_seeded_search(
+					best_index,
+					best_cost,
+					LMM_hybrid_stats,
+					Features_proj,
+					Projector_evaluation,
+					DB,
+					query,
+					Projector,
+					0.0f,
+					search_ignore_frames,
+					search_ignore_frames,
+					LMM_hybrid_bound_scale,
+					LMM_hybrid_sufficient_distance,
+					contact_filter);
+
+				if (LMM_hybrid_stats.searches % 100 == 0)
+				{
+					UE_LOG(LogTemp, Log, TEXT("Hybrid search: %d searches, projector sufficient %.1f%%, fallbacks %.1f%%"),
+						LMM_hybrid_stats.searches,
+						100.0f * LMM_hybrid_stats.projector_sufficient / LMM_hybrid_stats.searches,
+						100.0f * LMM_hybrid_stats.fallbacks / LMM_hybrid_stats.searches);
+				}
+			}
+			else if (Search_anytime_enabled && !force_search && !end_of_anim)
+			{
+				// Not in a critical transition so the search 
+				// can be spread over several ticks if needed
+				database_search_begin(
+					Search_cursor,
+					DB,
+					query,
+					best_index,
+					best_cost,
+					0.0f,
+					search_ignore_frames,
+					search_ignore_frames,
+					contact_filter);
+
+				Search_pending = !database_search_continue(Search_cursor, DB, Search_work_budget, Search_time_budget);
+				best_index = Search_cursor.best_index;
+
+				// Read in the best candidate so far while the search 
+				// continues as it is likely to be transitioned to
+				if (Search_pending && best_index != -1)
+				{
+					database_prefetch(DB, best_index);
+				}
+			}
+			else
+			{
+				database_search(
+					best_index,
+					best_cost,
+					DB,
+					query,
+					0.0f,
+					search_ignore_frames,
+					search_ignore_frames,
+					contact_filter);
+			}
 
-				Frame_index = best_index;
+			if (!Search_pending)
+			{
+				search_finished = true;
+				search_best_index = best_index;
+				search_curr_index = Frame_index;
 			}
 		}
 
@@ -2089,6 +2329,46 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 	// Tick down search timer
 	Search_timer -= DeltaT;
 
+	// Transition if better frame found
+	if (search_finished && search_best_index != -1 && search_best_index != search_curr_index)
+	{
+		// A paged database may fail to read the pose in, in which case
+		// the transition is refused and playback carries on as it was
+		if (database_pose(
+				Trns_bone_positions,
+				Trns_bone_velocities,
+				Trns_bone_rotations,
+				Trns_bone_angular_velocities,
+				DB,
+				search_best_index))
+		{
+			inertialize_pose_transition(
+				Bone_offset_positions,
+				Bone_offset_velocities,
+				Bone_offset_rotations,
+				Bone_offset_angular_velocities,
+				Transition_src_position,
+				Transition_src_rotation,
+				Transition_dst_position,
+				Transition_dst_rotation,
+				Bone_positions(0),
+				Bone_velocities(0),
+				Bone_rotations(0),
+				Bone_angular_velocities(0),
+				Curr_bone_positions,
+				Curr_bone_velocities,
+				Curr_bone_rotations,
+				Curr_bone_angular_velocities,
+				Trns_bone_positions,
+				Trns_bone_velocities,
+				Trns_bone_rotations,
+				Trns_bone_angular_velocities);
+
+			Frame_index = search_best_index;
+			Frame_alpha = 0.0f;
+		}
+	}
+
 	if (LMM_enabled)
 	{
 		// Update features and latents
@@ -2116,15 +2396,27 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 	}
 	else
 	{
-		// Tick frame
-		Frame_index++; // Assumes dt is fixed to 60fps
+		// Tick frame. The clock advances in whole database frames 
+		// and the remainder is used to interpolate between them so
+		// playback speed doesn't depend on the tick or database rate.
+		Frame_alpha += DeltaT * DB.frame_rate;
+		while (Frame_alpha >= 1.0f)
+		{
+			Frame_index = database_trajectory_index_clamp(DB, Frame_index, 1);
+			Frame_alpha -= 1.0f;
+		}
 
 		// Look-up Next Pose
-		Curr_bone_positions = DB.bone_positions(Frame_index);
-		Curr_bone_velocities = DB.bone_velocities(Frame_index);
-		Curr_bone_rotations = DB.bone_rotations(Frame_index);
-		Curr_bone_angular_velocities = DB.bone_angular_velocities(Frame_index);
-		Curr_bone_contacts = DB.contact_states(Frame_index);
+		database_pose_interpolated(
+			Curr_bone_positions,
+			Curr_bone_velocities,
+			Curr_bone_rotations,
+			Curr_bone_angular_velocities,
+			DB,
+			Frame_index,
+			Frame_alpha);
+		database_contacts(Curr_bone_contacts, DB, Frame_alpha < 0.5f ? 
+			Frame_index : database_trajectory_index_clamp(DB, Frame_index, 1));
 	}
 
 	// Update inertializer
@@ -2445,7 +2737,15 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 	SetCharacterAnimation();
 
 	//Draw matched features
-	array1d<float> current_features = LMM_enabled ? slice1d<float>(Features_curr) : DB.features(Frame_index);
+	array1d<float> current_features(DB.nfeatures());
+	if (LMM_enabled)
+	{
+		current_features = Features_curr;
+	}
+	else
+	{
+		database_features(current_features, DB, Frame_index);
+	}
 	denormalize_features(current_features, DB.features_offset, DB.features_scale);
 	Draw_features(current_features, Bone_positions(0), Bone_rotations(0), FColor::Blue); //
 
@@ -2578,16 +2878,19 @@ void AMotionMatchingCharacter::MotionMatchingMainTick() {
 
 void AMotionMatchingCharacter::DataBaseLog() {
 
+	const database& DB = Asset->db;
+
 	// Pose & Inertializer Data
 
 	int frame_index = DB.range_starts(0);
 
-	array1d<vec3> bone_positions = DB.bone_positions(frame_index);
-	array1d<vec3> bone_velocities = DB.bone_velocities(frame_index);
-	array1d<quat> bone_rotations = DB.bone_rotations(frame_index);
+	array1d<vec3> bone_positions(DB.nbones());
+	array1d<vec3> bone_velocities(DB.nbones());
+	array1d<quat> bone_rotations(DB.nbones());
+	database_pose(bone_positions, bone_velocities, bone_rotations, slice1d<vec3>(0, NULL), DB, frame_index);
 
 	//db data  Ǿ Log  Ȯ
-	UE_LOG(LogTemp, Log, TEXT("Joints Num: %d"), bone_rotations.size);
+	UE_LOG(LogTemp, Log, TEXT("Joints Num: %d"), (int)bone_rotations.size);
 
 	for (int i = 0; i < bone_rotations.size; i++) {
 
@@ -2597,6 +2900,212 @@ void AMotionMatchingCharacter::DataBaseLog() {
 }
 
 
+void AMotionMatchingCharacter::AppendDatabaseClips(const FString& FileName) {
+
+	// The database is still being built on a worker thread
+	if (!Motion_matching_ready)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Cannot append clips before motion matching is ready"));
+		return;
+	}
+
+	if (Asset->db.paged())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Cannot append clips to a database with paged poses"));
+		return;
+	}
+
+	// The mirrored frames of every character sharing the database 
+	// would be renumbered by the frames appended
+	if (Asset->db.mirrored())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Cannot append clips to a mirrored database"));
+		return;
+	}
+
+	// The clips are appended to the data shared with every character 
+	// of this type, which no longer matches its settings, so characters
+	// spawned afterwards load their own copy
+	motion_matching_asset_forget(Asset);
+
+	database& DB = Asset->db;
+
+	FString ClipsFilePath = FPaths::ProjectContentDir() + TEXT("/") + FileName;
+	const char* ClipsFilePathChar = TCHAR_TO_ANSI(*ClipsFilePath);
+
+	database clips;
+	database_load(clips, ClipsFilePathChar);
+	clips.frame_rate = DB.frame_rate;
+
+	double start_time = FPlatformTime::Seconds();
+
+	// Only the new frames are processed, using the normalization of the loaded database
+	database_append(DB, clips);
+
+	UE_LOG(LogTemp, Log, TEXT("Appended %d frames in %d ranges in %f ms (database now %d frames)"),
+		clips.nframes(), clips.nranges(), 1000.0 * (FPlatformTime::Seconds() - start_time), DB.nframes());
+}
+
+
+void AMotionMatchingCharacter::ReloadMotionMatchingData() {
+
+	if (!Motion_matching_ready)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Cannot reload before motion matching is ready"));
+		return;
+	}
+
+	// The files may still be mapped or paged from, which is not safe
+	// to overwrite or read from again while in use
+	if (!Database_hot_reload)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Cannot reload motion matching data unless Database_hot_reload is set"));
+		return;
+	}
+
+	if (Reload_asset.IsValid())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Motion matching data is already being reloaded"));
+		return;
+	}
+
+	// Shared with the other characters reloading the same data
+	Reload_start_time = FPlatformTime::Seconds();
+	Reload_asset = motion_matching_asset_reload(Reload_loading, Asset_settings, Asset);
+	Reload_searching = false;
+}
+
+
+void AMotionMatchingCharacter::MotionMatchingReloadTick() {
+
+	if (!Reload_loading.IsValid() || !Reload_loading.IsReady())
+	{
+		return;
+	}
+
+	const database& DB = Asset->db;
+	const database& Reload_DB = Reload_asset->db;
+
+	if (!Reload_searching)
+	{
+		// The pose playing can only be carried over to data with the 
+		// same skeleton and features
+		if (Reload_DB.nranges() == 0 ||
+			Reload_DB.nbones() != DB.nbones() ||
+			Reload_DB.nfeatures() != DB.nfeatures() ||
+			Reload_DB.ncontacts() != DB.ncontacts())
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Reloaded data has %d bones and %d features rather than %d and %d, keeping the data playing"),
+				Reload_DB.nbones(), Reload_DB.nfeatures(), DB.nbones(), DB.nfeatures());
+
+			Reload_asset.Reset();
+			Reload_loading = TSharedFuture<void>();
+			return;
+		}
+
+		// Search the reloaded data for the frame closest to the one
+		// playing, with the features of the one playing as the query
+		array1d<float> Reload_query(DB.nfeatures());
+		database_features(Reload_query, DB, Frame_index);
+
+		for (int i = 0; i < Reload_query.size; i++)
+		{
+			Reload_query(i) = Reload_query(i) * DB.features_scale(i) + DB.features_offset(i);
+		}
+
+		int search_ignore_frames = (int)(Search_ignore_time * Reload_DB.frame_rate + 0.5f);
+
+		database_search_begin(
+			Reload_cursor,
+			Reload_DB,
+			Reload_query,
+			-1,
+			FLT_MAX,
+			0.0f,
+			search_ignore_frames,
+			search_ignore_frames,
+			0);
+
+		Reload_searching = true;
+	}
+
+	// Spread over ticks with the same budget as other searches
+	if (!database_search_continue(Reload_cursor, Reload_DB, Search_work_budget, Search_time_budget))
+	{
+		return;
+	}
+
+	int Reload_index = Reload_cursor.best_index != -1 ? Reload_cursor.best_index : Reload_DB.range_starts(0);
+
+	// Swap in the reloaded data. Any search in progress was over the old data.
+
+	motion_matching_asset_ptr Old_asset = MoveTemp(Asset);
+	Asset = MoveTemp(Reload_asset);
+	Asset_loading = MoveTemp(Reload_loading);
+	Reload_loading = TSharedFuture<void>();
+	Reload_searching = false;
+	Search_pending = false;
+
+	// Transition to the frame found as for any other search
+
+	database_pose(
+		Trns_bone_positions,
+		Trns_bone_velocities,
+		Trns_bone_rotations,
+		Trns_bone_angular_velocities,
+		Reload_DB,
+		Reload_index);
+
+	inertialize_pose_transition(
+		Bone_offset_positions,
+		Bone_offset_velocities,
+		Bone_offset_rotations,
+		Bone_offset_angular_velocities,
+		Transition_src_position,
+		Transition_src_rotation,
+		Transition_dst_position,
+		Transition_dst_rotation,
+		Bone_positions(0),
+		Bone_velocities(0),
+		Bone_rotations(0),
+		Bone_angular_velocities(0),
+		Curr_bone_positions,
+		Curr_bone_velocities,
+		Curr_bone_rotations,
+		Curr_bone_angular_velocities,
+		Trns_bone_positions,
+		Trns_bone_velocities,
+		Trns_bone_rotations,
+		Trns_bone_angular_velocities);
+
+	Frame_index = Reload_index;
+	Frame_alpha = 0.0f;
+
+	// The networks were reloaded too so learned motion matching 
+	// restarts from the features of the new frame
+
+	Decompressor_evaluation.resize(Asset->decompressor);
+	Stepper_evaluation.resize(Asset->stepper);
+	Projector_evaluation.resize(Asset->projector);
+
+	Features_curr.resize(Reload_DB.nfeatures());
+	database_features(Features_curr, Reload_DB, Frame_index);
+	Features_proj = Features_curr;
+	Latent_proj.zero();
+	Latent_curr.zero();
+
+	UE_LOG(LogTemp, Log, TEXT("Reloaded motion matching data in %f ms, continuing from frame %d"),
+		1000.0 * (FPlatformTime::Seconds() - Reload_start_time), Frame_index);
+
+	// This may be the last reference to the old data, which is 
+	// freed on a worker thread rather than hitching the game thread
+	Async(EAsyncExecution::ThreadPool, [Old_asset = MoveTemp(Old_asset)]() mutable
+	{
+		Old_asset.Reset();
+	});
+}
+
+
 void AMotionMatchingCharacter::SaveBasicRotators() {
 
 	//Root WorldSpace  
@@ -2628,13 +3137,15 @@ void AMotionMatchingCharacter::SaveBasicVectors() {
 
 void AMotionMatchingCharacter::CharacterLoadTest() {
 
+	character Character_data;
+
 	FString CharacterFilePath = FPaths::ProjectContentDir() + TEXT("/character.bin");
 	const char* CharacterFilePathChar = TCHAR_TO_ANSI(*CharacterFilePath); 	// TCHAR_TO_ANSI ũθ Ͽ ȯ
 	character_load(Character_data, CharacterFilePathChar);
 
-	UE_LOG(LogTemp, Log, TEXT("positions length: %d"), Character_data.positions.size);
-	UE_LOG(LogTemp, Log, TEXT("bone_rest_positions length: %d"), Character_data.bone_rest_positions.size);
-	UE_LOG(LogTemp, Log, TEXT("bone_rest_rotations length: %d"), Character_data.bone_rest_rotations.size);
+	UE_LOG(LogTemp, Log, TEXT("positions length: %d"), (int)Character_data.positions.size);
+	UE_LOG(LogTemp, Log, TEXT("bone_rest_positions length: %d"), (int)Character_data.bone_rest_positions.size);
+	UE_LOG(LogTemp, Log, TEXT("bone_rest_rotations length: %d"), (int)Character_data.bone_rest_rotations.size);
 
 	//character_bone_rest_rotations 
 	for (int i = 0; i < Character_data.bone_rest_rotations.size; i++) {
@@ -2651,6 +3162,8 @@ void AMotionMatchingCharacter::CharacterLoadTest() {
 
 void AMotionMatchingCharacter::SetCharacterPositionRest() {
 
+	const character& Character_data = Asset->character_data;
+
 	int scale = 100;
 
 	// 
@@ -2676,6 +3189,8 @@ void AMotionMatchingCharacter::SetCharacterPositionRest() {
 
 void AMotionMatchingCharacter::SetCharacterRotationRest() {
 
+	const character& Character_data = Asset->character_data;
+
 	float pi = 3.141592;
 
 	int scale = (180/pi);
@@ -2714,6 +3229,8 @@ void AMotionMatchingCharacter::SetCharacterRotationRest() {
 
 void AMotionMatchingCharacter::PoseTest(int frameindex) {
 
+	const database& DB = Asset->db;
+
 	float pi = 3.141592;
 
 	//int scale = (180/pi);
@@ -2723,7 +3240,8 @@ void AMotionMatchingCharacter::PoseTest(int frameindex) {
 	int JointsNum = JointsNames.Num();
 
 	//dbκ ϴ frame rotation data 
-	array1d<quat> bone_rotations = DB.bone_rotations(frameindex);
+	array1d<quat> bone_rotations(DB.nbones());
+	database_pose(slice1d<vec3>(0, NULL), slice1d<vec3>(0, NULL), bone_rotations, slice1d<vec3>(0, NULL), DB, frameindex);
 
 
 	//  ʹϾ   //curr_bone_rotations.size
@@ -2752,13 +3270,16 @@ void AMotionMatchingCharacter::PoseTest(int frameindex) {
 
 void AMotionMatchingCharacter::PoseTestByPostion(int frameindex) {
 
+	const database& DB = Asset->db;
+
 	int scale = 100;
 
 	// 
 	int JointsNum = JointsNames.Num();
 
 	//dbκ ϴ frame rotation data 
-	array1d<vec3> bone_positions = DB.bone_positions(frameindex);
+	array1d<vec3> bone_positions(DB.nbones());
+	database_pose(bone_positions, slice1d<vec3>(0, NULL), slice1d<quat>(0, NULL), slice1d<vec3>(0, NULL), DB, frameindex);
 
 	//  position   //curr_bone_rotations.size
 	TArray<FVector> JointsVector;
@@ -2921,7 +3442,7 @@ void AMotionMatchingCharacter::InputLog()
 	//array1d<vec3> Obstacles_positions = array1d<vec3>(0);
 	//array1d<vec3> Obstacles_scales = array1d<vec3>(0);
 
-	UE_LOG(LogTemp, Log, TEXT("Num of Obstacles : %d"), Obstacles_positions.size);
+	UE_LOG(LogTemp, Log, TEXT("Num of Obstacles : %d"), (int)Obstacles_positions.size);
 
 	for (int i = 0; i < Obstacles_positions.size; i++) {
 
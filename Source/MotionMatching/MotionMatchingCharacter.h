@@ -15,6 +15,7 @@
 #include "MMdatabase.h"
 #include "MMnnet.h"
 #include "MMlmm.h"
+#include "MMasset.h"
 
 
 #include "MotionMatchingCharacter.generated.h"
@@ -31,6 +32,8 @@ struct FInputActionValue;
 
 DECLARE_LOG_CATEGORY_EXTERN(LogTemplateCharacter, Log, All);
 
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FMotionMatchingReadySignature, float, LoadTime);
+
 UCLASS(config=Game)
 class AMotionMatchingCharacter : public ACharacter
 {
@@ -126,6 +129,9 @@ protected:
 	// To add mapping context
 	virtual void BeginPlay();
 
+	// Release the shared motion matching data
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 	// Tick Լ
 	virtual void Tick(float DeltaTime) override;
 
@@ -208,8 +214,35 @@ protected: //Motion Matching 
 	array1d<vec3> Obstacles_scales = array1d<vec3>(0);
 
 
-	// Load Animation Data and build Matching Database
-	database DB; //database.bin features.bin  DB 
+	// Memory map the database files and view them in place rather 
+	// than reading them into memory
+	bool Database_memory_mapped = true;
+	bool Database_huge_pages = false;
+
+	// Read the files into memory rather than mapping or paging poses
+	// from them, so they can be exported again while playing and 
+	// reloaded with ReloadMotionMatchingData
+	bool Database_hot_reload = false;
+
+	// Character, database and networks, loaded on worker threads 
+	// during BeginPlay and shared by every character loading them 
+	// with the same settings. Until loading completes the character
+	// holds the T-pose of its mesh.
+	motion_matching_asset_ptr Asset;
+	TSharedFuture<void> Asset_loading;
+	bool Motion_matching_ready = false;
+	double Load_start_time = 0.0;
+	float Load_time = 0.0f;
+
+	// Data reloaded with the same settings. It is loaded and searched
+	// for the frame closest to the one playing in the background, then
+	// swapped in at the start of a tick.
+	motion_matching_asset_settings Asset_settings;
+	motion_matching_asset_ptr Reload_asset;
+	TSharedFuture<void> Reload_loading;
+	database_search_cursor Reload_cursor;
+	bool Reload_searching = false;
+	double Reload_start_time = 0.0;
 
 	//feature   Ǵ weight 
 	float Feature_weight_foot_position = 0.75f;
@@ -218,11 +251,47 @@ protected: //Motion Matching 
 	float Feature_weight_trajectory_positions = 1.0f;
 	float Feature_weight_trajectory_directions = 1.5f;
 
-	// Character
-	character Character_data;
+	// Layout of the matching features. By default made from the weights 
+	// above but channels can be added or dropped before the database is built
+	feature_schema Feature_schema;
+
+	// Reorder frames by feature space locality before building the search bounds
+	bool Feature_reorder_frames = true;
+
+	// Store pose rotations and positions quantized, decoding them on access
+	bool Database_compress_poses = false;
+
+	// Drop the stored velocities, deriving them from the poses when read
+	bool Database_derive_velocities = false;
+
+	// Read poses in from the database file per range when needed,
+	// keeping at most this many megabytes of them in memory
+	bool Database_page_poses = false;
+	int Database_page_budget_mb = 64;
+
+	// Exclude frames with a near duplicate elsewhere from the search 
+	// when above zero, as a distance between normalized features
+	float Database_prune_tolerance = 0.0f;
+
+	// Record the query of every search, saved to queries.bin when play
+	// ends so pruning can report how much worse they would match
+	bool Record_queries = false;
+	TArray<float> Recorded_queries;
+
+	// Search and play back the mirror image of every frame as well,
+	// without storing them. `Frame_index` is then past the frames of
+	// the database when playing a mirrored one.
+	bool Database_mirror = false;
 
 	// Pose & Inertializer Data
 	int Frame_index;
+
+	// Playback clock. Time elapsed since `Frame_index` in database 
+	// frames, used to interpolate the pose played back.
+	float Frame_alpha = 0.0f;
+
+	// Rate the database was sampled at, such as 30 or 60 Hz
+	float Database_frame_rate = 60.0f;
 	float Inertialize_blending_halflife = 0.1f;
 
 	array1d<vec3> Curr_bone_positions;
@@ -264,6 +333,17 @@ protected: //Motion Matching 
 	float Search_timer;
 	float Force_search_timer;
 
+	// Non-critical searches are spread over several ticks, 
+	// doing at most this much work (or time in seconds) per tick
+	bool Search_anytime_enabled = true;
+	int Search_work_budget = 4096;
+	double Search_time_budget = 0.0005;
+	database_search_cursor Search_cursor;
+	bool Search_pending = false;
+
+	// Only transition to frames where one of the feet is planted.
+	bool Search_require_contact = false;
+
 	vec3 Desired_velocity;
 	vec3 Desired_velocity_change_curr;
 	vec3 Desired_velocity_change_prev;
@@ -373,7 +453,6 @@ protected: //Motion Matching 
 	UPROPERTY(BlueprintReadWrite)
 	bool LMM_enabled;
 
-	nnet Decompressor, Stepper, Projector;
 	nnet_evaluation Decompressor_evaluation, Stepper_evaluation, Projector_evaluation;
 
 	array1d<float> Features_proj;
@@ -381,6 +460,15 @@ protected: //Motion Matching 
 	array1d<float> Latent_proj = array1d<float>(32);
 	array1d<float> Latent_curr = array1d<float>(32);
 
+	// Hybrid search: when LMM is off the projector is still used 
+	// to find an initial bound for the exact database search. It 
+	// takes precedence over spreading searches over several ticks.
+	UPROPERTY(BlueprintReadWrite)
+	bool LMM_hybrid_enabled;
+	float LMM_hybrid_bound_scale = 1.5f;
+	float LMM_hybrid_sufficient_distance = 0.1f;
+	projector_search_stats LMM_hybrid_stats;
+
 	//DeltTime(FrameRate)
 	//float DeltaT = 1.0f / 60.0f; //dt
 	float DeltaT = 1.0f / 60.0f; //dt
@@ -426,6 +514,22 @@ public: //Motion Matching 
 	UFUNCTION()
 	void MotionMatchingMainBeginPlay(); //MotionMatching  ʱ  load Լ  Ե(ʱ  ʱȭ)
 
+	// Initialize the pose and playback state once the asset has loaded
+	UFUNCTION()
+	void MotionMatchingMainReady();
+
+	// If the character has finished loading and is motion matching
+	UFUNCTION(BlueprintPure)
+	bool IsMotionMatchingReady() const;
+
+	// Seconds from BeginPlay until motion matching was ready, or zero before then
+	UFUNCTION(BlueprintPure)
+	float GetMotionMatchingLoadTime() const;
+
+	// Broadcast on the game thread once motion matching is ready
+	UPROPERTY(BlueprintAssignable)
+	FMotionMatchingReadySignature OnMotionMatchingReady;
+
 	UFUNCTION()
 	void MotionMatchingMainTick(); 
 
@@ -440,6 +544,22 @@ public: //Motion Matching 
 	UFUNCTION()
 	void DataBaseLog();
 
+	// Load a database file from the content directory and append 
+	// its clips to the motion matching database at runtime
+	UFUNCTION(BlueprintCallable)
+	void AppendDatabaseClips(const FString& FileName);
+
+	// Load the character, database and networks from the content 
+	// directory again in the background, such as after exporting them
+	// again, and swap them in once ready without stopping playback.
+	// Requires Database_hot_reload.
+	UFUNCTION(BlueprintCallable)
+	void ReloadMotionMatchingData();
+
+	// Continue a reload, swapping in the reloaded data once it is 
+	// loaded and the frame to continue playing from is found
+	void MotionMatchingReloadTick();
+
 	UFUNCTION()
 	void InputLog();
 	
@@ -584,6 +704,7 @@ public: //Motion Matching 
 	void query_compute_trajectory_position_feature(
 		slice1d<float> query,
 		int& offset,
+		const feature_channel& channel,
 		const vec3 root_position,
 		const quat root_rotation,
 		const slice1d<vec3> trajectory_positions);
@@ -592,6 +713,7 @@ public: //Motion Matching 
 	void query_compute_trajectory_direction_feature(
 		slice1d<float> query,
 		int& offset,
+		const feature_channel& channel,
 		const quat root_rotation,
 		const slice1d<quat> trajectory_rotations);
 	
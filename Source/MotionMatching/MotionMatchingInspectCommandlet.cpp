@@ -0,0 +1,159 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "MotionMatchingInspectCommandlet.h"
+
+#include "MMcharacter.h"
+#include "MMdatabase.h"
+#include "MMformat.h"
+#include "MMinspect.h"
+#include "MMnnet.h"
+
+#include "Misc/Paths.h"
+
+UMotionMatchingInspectCommandlet::UMotionMatchingInspectCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+//---------------------------------------------------------------
+// Wall clock seconds spent in each stage of loading and building
+struct inspect_timer
+{
+    double start = 0.0;
+};
+
+static void inspect_timer_start(inspect_timer& timer)
+{
+    timer.start = FPlatformTime::Seconds();
+}
+
+static void inspect_timer_stop(inspect_timer& timer, const char* stage)
+{
+    printf("    %-28s %10.3f ms\n", stage, (FPlatformTime::Seconds() - timer.start) * 1000.0);
+}
+
+int32 UMotionMatchingInspectCommandlet::Main(const FString& Params)
+{
+    FString Directory = FPaths::ProjectContentDir();
+    FParse::Value(*Params, TEXT("Dir="), Directory);
+
+    float frame_rate = 60.0f;
+    FParse::Value(*Params, TEXT("Rate="), frame_rate);
+
+    bool reorder_frames = !FParse::Param(*Params, TEXT("NoReorder"));
+    bool mirror = FParse::Param(*Params, TEXT("Mirror"));
+
+    FString DatabasePath = Directory + TEXT("/database.bin");
+
+    if (!FPaths::FileExists(DatabasePath))
+    {
+        printf("No database.bin in %s\n", TCHAR_TO_ANSI(*Directory));
+        return 1;
+    }
+
+    // Rewrite the files in the versioned format first, which is a
+    // plain load and save so files already converted are unchanged
+    if (FParse::Param(*Params, TEXT("Convert")))
+    {
+        const char* files[5] = { "character", "database", "decompressor", "stepper", "projector" };
+        const int kinds[5] = { FORMAT_CHARACTER, FORMAT_DATABASE, FORMAT_NNET, FORMAT_NNET, FORMAT_NNET };
+
+        for (int i = 0; i < 5; i++)
+        {
+            FString FilePath = Directory + TEXT("/") + ANSI_TO_TCHAR(files[i]) + TEXT(".bin");
+            if (!FPaths::FileExists(FilePath))
+            {
+                continue;
+            }
+
+            format_convert(TCHAR_TO_ANSI(*FilePath), TCHAR_TO_ANSI(*FilePath), kinds[i]);
+            printf("Converted %s.bin\n", files[i]);
+        }
+
+        printf("\n");
+    }
+
+    // Same schema and ignored frames as the characters by default
+    feature_schema schema;
+    feature_schema_default(schema, 0.75f, 1.0f, 1.0f, 1.0f, 1.5f, frame_rate);
+    int ignore_range_end = (int)(20.0f / 60.0f * frame_rate + 0.5f);
+
+    inspect_timer timer;
+    printf("Timing\n");
+
+    database db;
+    inspect_timer_start(timer);
+    database_load(db, TCHAR_TO_ANSI(*DatabasePath));
+    db.frame_rate = frame_rate;
+    inspect_timer_stop(timer, "load database.bin");
+
+    if (mirror)
+    {
+        array1d<int> contact_bones(2);
+        contact_bones(0) = Bone_LeftToe;
+        contact_bones(1) = Bone_RightToe;
+
+        inspect_timer_start(timer);
+        database_mirror(db, contact_bones);
+        inspect_timer_stop(timer, "mirror");
+    }
+
+    inspect_timer_start(timer);
+    uint64_t hash = database_source_hash(TCHAR_TO_ANSI(*DatabasePath), db, schema, reorder_frames);
+    inspect_timer_stop(timer, "hash source");
+
+    FString BakedPath = FString::Printf(TEXT("%s/database_baked_%016llx.bin"), *Directory, (unsigned long long)hash);
+
+    // Building is always timed, replacing the baked features if they
+    // loaded, since that is what changing the data or schema costs
+    inspect_timer_start(timer);
+    bool baked_loaded = database_load_baked(db, TCHAR_TO_ANSI(*BakedPath), hash);
+    inspect_timer_stop(timer, baked_loaded ? "load database_baked.bin" : "load database_baked.bin (stale)");
+
+    inspect_timer_start(timer);
+    database_build_matching_features(db, schema, reorder_frames);
+    inspect_timer_stop(timer, "build features and bounds");
+
+    inspect_timer_start(timer);
+    database_build_bounds(db);
+    inspect_timer_stop(timer, "build bounds alone");
+
+    const char* networks[3] = { "decompressor", "stepper", "projector" };
+    nnet nns[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        FString NetworkPath = Directory + TEXT("/") + ANSI_TO_TCHAR(networks[i]) + TEXT(".bin");
+        if (!FPaths::FileExists(NetworkPath))
+        {
+            continue;
+        }
+
+        char stage[64];
+        snprintf(stage, sizeof(stage), "load %s.bin", networks[i]);
+
+        inspect_timer_start(timer);
+        nnet_load(nns[i], TCHAR_TO_ANSI(*NetworkPath));
+        inspect_timer_stop(timer, stage);
+    }
+
+    printf("\n");
+    int problems = database_inspect(stdout, db, ignore_range_end);
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (nns[i].weights.size() > 0)
+        {
+            printf("\n");
+            problems += nnet_inspect(stdout, nns[i], networks[i]);
+        }
+    }
+
+    fflush(stdout);
+
+    return problems > 0 ? 1 : 0;
+}
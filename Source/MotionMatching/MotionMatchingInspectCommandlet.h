@@ -0,0 +1,29 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MotionMatchingInspectCommandlet.generated.h"
+
+/**
+ * Load the motion matching data the way characters do, timing each
+ * stage, and print a report on the database and networks. Returns
+ * non zero if any problem was found so it can gate builds. Run with
+ *
+ *   UnrealEditor-Cmd MotionMatching.uproject -run=MotionMatchingInspect
+ *       [-Dir=<data directory>] [-Rate=60] [-NoReorder] [-Mirror] [-Convert]
+ *
+ * The data directory defaults to the project content directory. With
+ * -Convert the files in it are first rewritten in the versioned format.
+ */
+UCLASS()
+class MOTIONMATCHING_API UMotionMatchingInspectCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UMotionMatchingInspectCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};